@@ -19,11 +19,12 @@
 #include "pnp.h"
 #include "loader.h"
 #include <linux/kernel_stat.h>
+#include <linux/prefetch.h>
 #include <asm/dma.h>
 #include "ndis_exports.h"
 
-#define MAX_ALLOCATED_NDIS_PACKETS TX_RING_SIZE
-#define MAX_ALLOCATED_NDIS_BUFFERS TX_RING_SIZE
+#define MAX_PREALLOCATED_NDIS_PACKETS 1024
+#define MAX_PREALLOCATED_NDIS_BUFFERS 1024
 
 static struct work_struct ndis_work;
 static struct nt_list ndis_work_list;
@@ -452,6 +453,32 @@ static int read_setting(struct nt_list *setting_list, char *keyname, int length,
 	EXIT2(return -1);
 }
 
+/* integer value of setting 'name' for the device (or its driver), or
+ * 'def' if it is not set; for wrapper's own settings */
+int ndis_get_setting_int(struct ndis_device *wnd, const char *name, int def)
+{
+	struct wrap_device_setting *setting;
+	int ret = def;
+
+	mutex_lock(&loader_mutex);
+	nt_list_for_each_entry(setting, &wnd->wd->settings, list) {
+		if (stricmp(name, setting->name) == 0) {
+			ret = simple_strtol(setting->value, NULL, 0);
+			goto out;
+		}
+	}
+	nt_list_for_each_entry(setting, &wnd->wd->driver->settings, list) {
+		if (stricmp(name, setting->name) == 0) {
+			ret = simple_strtol(setting->value, NULL, 0);
+			goto out;
+		}
+	}
+out:
+	mutex_unlock(&loader_mutex);
+	TRACE2("%s: %d", name, ret);
+	return ret;
+}
+
 wstdcall void WIN_FUNC(NdisReadConfiguration,5)
 	(NDIS_STATUS *status, struct ndis_configuration_parameter **param,
 	 struct ndis_mp_block *nmb, struct unicode_string *key,
@@ -1174,22 +1201,76 @@ wstdcall NDIS_STATUS WIN_FUNC(NdisMAllocateSharedMemoryAsync,4)
  * work. Sadly, though, NdisFreeBuffer doesn't pass the pool_handle,
  * so we use 'process' field of MDL to store pool_handle. */
 
+/* descriptors of a buffer pool are allocated in one array when the
+ * pool is created; free descriptors are kept in a stack that is
+ * updated with cmpxchg64, without locks */
+
+#define buffer_pool_descr(pool, i)					\
+	((ndis_buffer *)((pool)->descr + (i) * MDL_CACHE_SIZE))
+
+static ndis_buffer *buffer_pool_get(struct ndis_buffer_pool *pool)
+{
+	u64 old, new;
+	u32 i;
+
+	do {
+		old = ACCESS_ONCE(pool->free_head);
+		i = (u32)old;
+		if (!i)
+			return NULL;
+		/* if descr[i - 1] is taken by someone else after
+		 * free_head is read, count changes and cmpxchg
+		 * fails */
+		new = ((old >> 32) + 1) << 32 | pool->next_descr[i - 1];
+	} while (cmpxchg64(&pool->free_head, old, new) != old);
+	return buffer_pool_descr(pool, i - 1);
+}
+
+static void buffer_pool_put(struct ndis_buffer_pool *pool, u32 i)
+{
+	u64 old, new;
+
+	do {
+		old = ACCESS_ONCE(pool->free_head);
+		pool->next_descr[i] = (u32)old;
+		new = (old & ~0xffffffffULL) | (i + 1);
+	} while (cmpxchg64(&pool->free_head, old, new) != old);
+}
+
 wstdcall void WIN_FUNC(NdisAllocateBufferPool,3)
 	(NDIS_STATUS *status, struct ndis_buffer_pool **pool_handle,
 	 UINT num_descr)
 {
 	struct ndis_buffer_pool *pool;
+	UINT i, n;
 
 	ENTER1("buffers: %d", num_descr);
-	pool = kmalloc(sizeof(*pool), irql_gfp());
+	pool = kzalloc(sizeof(*pool), irql_gfp());
 	if (!pool) {
 		*status = NDIS_STATUS_RESOURCES;
 		EXIT3(return);
 	}
-	spin_lock_init(&pool->lock);
+	/* some drivers ask for very large pools; beyond
+	 * MAX_PREALLOCATED_NDIS_BUFFERS, descriptors are allocated as
+	 * needed */
+	n = min_t(UINT, num_descr, MAX_PREALLOCATED_NDIS_BUFFERS);
+	pool->descr = kzalloc(n * MDL_CACHE_SIZE, irql_gfp());
+	pool->next_descr = kmalloc(n * sizeof(*pool->next_descr),
+				   irql_gfp());
+	if (n && (!pool->descr || !pool->next_descr)) {
+		kfree(pool->descr);
+		kfree(pool->next_descr);
+		kfree(pool);
+		*status = NDIS_STATUS_RESOURCES;
+		EXIT3(return);
+	}
+	pool->num_descr = n;
+	for (i = 0; i < n; i++)
+		pool->next_descr[i] = (i + 1 < n) ? i + 2 : 0;
+	pool->free_head = n ? 1 : 0;
 	pool->max_descr = num_descr;
+	pool->num_used_descr = 0;
 	pool->num_allocated_descr = 0;
-	pool->free_descr = NULL;
 	*pool_handle = pool;
 	*status = NDIS_STATUS_SUCCESS;
 	TRACE1("pool: %p, num_descr: %d", pool, num_descr);
@@ -1201,6 +1282,8 @@ wstdcall void WIN_FUNC(NdisAllocateBuffer,5)
 	 struct ndis_buffer_pool *pool, void *virt, UINT length)
 {
 	ndis_buffer *descr;
+	void *startva;
+	CSHORT flags;
 
 	ENTER4("pool: %p (%d)", pool, pool->num_allocated_descr);
 	/* NDIS drivers should call this at DISPATCH_LEVEL, but
@@ -1211,19 +1294,31 @@ wstdcall void WIN_FUNC(NdisAllocateBuffer,5)
 		*buffer = NULL;
 		EXIT4(return);
 	}
-	spin_lock_bh(&pool->lock);
-	if ((descr = pool->free_descr))
-		pool->free_descr = descr->next;
-	spin_unlock_bh(&pool->lock);
+	if (SPAN_PAGES(virt, length) <= MDL_CACHE_PAGES)
+		descr = buffer_pool_get(pool);
+	else
+		descr = NULL;
 	if (descr) {
-		typeof(descr->flags) flags;
+		atomic_inc_var(pool->num_used_descr);
+		startva = descr->startva;
 		flags = descr->flags;
-		memset(descr, 0, sizeof(*descr));
 		MmInitializeMdl(descr, virt, length);
-		if (flags & MDL_CACHE_ALLOCATED)
-			descr->flags |= MDL_CACHE_ALLOCATED;
+		descr->flags = MDL_ALLOCATED_FIXED_SIZE;
+		/* tx buffers are mostly in the same page as the last
+		 * time this descriptor was used, in which case page
+		 * array is still valid */
+		if ((flags & MDL_SOURCE_IS_NONPAGED_POOL) &&
+		    startva == descr->startva &&
+		    SPAN_PAGES(virt, length) == 1)
+			descr->flags |= MDL_SOURCE_IS_NONPAGED_POOL;
+		else
+			MmBuildMdlForNonPagedPool(descr);
 	} else {
-		if (pool->num_allocated_descr > pool->max_descr) {
+		/* buffers spanning more than MDL_CACHE_PAGES are
+		 * always allocated, so limit is checked against
+		 * descriptors in use */
+		if (pool->num_used_descr + pool->num_allocated_descr >=
+		    pool->max_descr) {
 			TRACE2("pool %p is full: %d(%d)", pool,
 			       pool->num_allocated_descr, pool->max_descr);
 #ifndef ALLOW_POOL_OVERFLOW
@@ -1241,9 +1336,9 @@ wstdcall void WIN_FUNC(NdisAllocateBuffer,5)
 		}
 		TRACE4("buffer %p for %p, %d", descr, virt, length);
 		atomic_inc_var(pool->num_allocated_descr);
+		/* TODO: make sure this mdl can map given buffer */
+		MmBuildMdlForNonPagedPool(descr);
 	}
-	/* TODO: make sure this mdl can map given buffer */
-	MmBuildMdlForNonPagedPool(descr);
 //	descr->flags |= MDL_ALLOCATED_FIXED_SIZE |
 //		MDL_MAPPED_TO_SYSTEM_VA | MDL_PAGES_LOCKED;
 	descr->pool = pool;
@@ -1257,6 +1352,7 @@ wstdcall void WIN_FUNC(NdisFreeBuffer,1)
 	(ndis_buffer *buffer)
 {
 	struct ndis_buffer_pool *pool;
+	unsigned long offset;
 
 	ENTER4("%p", buffer);
 	if (!buffer || !buffer->pool) {
@@ -1264,18 +1360,18 @@ wstdcall void WIN_FUNC(NdisFreeBuffer,1)
 		EXIT4(return);
 	}
 	pool = buffer->pool;
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_BUFFERS) {
+	offset = (char *)buffer - pool->descr;
+	if ((char *)buffer >= pool->descr &&
+	    offset < pool->num_descr * MDL_CACHE_SIZE) {
+		buffer_pool_put(pool, offset / MDL_CACHE_SIZE);
+		atomic_dec_var(pool->num_used_descr);
+	} else {
 		/* NB NB NB: set mdl's 'pool' field to NULL before
 		 * calling free_mdl; otherwise free_mdl calls
 		 * NdisFreeBuffer back */
 		atomic_dec_var(pool->num_allocated_descr);
 		buffer->pool = NULL;
 		free_mdl(buffer);
-	} else {
-		spin_lock_bh(&pool->lock);
-		buffer->next = pool->free_descr;
-		pool->free_descr = buffer;
-		spin_unlock_bh(&pool->lock);
 	}
 	EXIT4(return);
 }
@@ -1283,24 +1379,18 @@ wstdcall void WIN_FUNC(NdisFreeBuffer,1)
 wstdcall void WIN_FUNC(NdisFreeBufferPool,1)
 	(struct ndis_buffer_pool *pool)
 {
-	ndis_buffer *cur, *next;
-
 	TRACE3("pool: %p", pool);
 	if (!pool) {
 		WARNING("invalid pool");
 		EXIT3(return);
 	}
-	spin_lock_bh(&pool->lock);
-	cur = pool->free_descr;
-	while (cur) {
-		next = cur->next;
-		cur->pool = NULL;
-		free_mdl(cur);
-		cur = next;
-	}
-	spin_unlock_bh(&pool->lock);
+	/* buffers not in descr are freed when they are returned */
+	if (pool->num_allocated_descr)
+		WARNING("%d buffers of pool %p not freed",
+			pool->num_allocated_descr, pool);
+	kfree(pool->descr);
+	kfree(pool->next_descr);
 	kfree(pool);
-	pool = NULL;
 	EXIT3(return);
 }
 
@@ -1442,11 +1532,57 @@ wstdcall void WIN_FUNC(NdisGetFirstBufferFromPacket,6)
 					 NormalPagePriority);
 }
 
+/* packet descriptors are cached in per-cpu magazines, so in the
+ * common case they are allocated and freed without taking
+ * pool->lock; magazines are refilled from, and flushed to, pool's
+ * free_descr list. Magazines are accessed with bottom halves
+ * disabled, as packets are allocated in tx_skbuff */
+
+/* called with bottom halves disabled */
+static void packet_magazine_refill(struct ndis_packet_pool *pool,
+				   struct ndis_packet_magazine *mag)
+{
+	struct ndis_packet *packet;
+
+	spin_lock(&pool->lock);
+	while (mag->count < PACKET_MAGAZINE_SIZE / 2 &&
+	       (packet = pool->free_descr)) {
+		pool->free_descr = (void *)packet->reserved[0];
+		mag->packets[mag->count++] = packet;
+	}
+	spin_unlock(&pool->lock);
+}
+
+/* called with bottom halves disabled */
+static void packet_magazine_flush(struct ndis_packet_pool *pool,
+				  struct ndis_packet_magazine *mag)
+{
+	struct ndis_packet *packet;
+
+	spin_lock(&pool->lock);
+	while (mag->count > PACKET_MAGAZINE_SIZE / 2) {
+		packet = mag->packets[--mag->count];
+		/* packets allocated after pool overflowed are not
+		 * kept */
+		if (pool->num_allocated_descr > pool->max_descr) {
+			pool->num_allocated_descr--;
+			kfree(packet);
+		} else {
+			packet->reserved[0] =
+				(typeof(packet->reserved[0]))pool->free_descr;
+			pool->free_descr = packet;
+		}
+	}
+	spin_unlock(&pool->lock);
+}
+
 wstdcall void WIN_FUNC(NdisAllocatePacketPoolEx,5)
 	(NDIS_STATUS *status, struct ndis_packet_pool **pool_handle,
 	 UINT num_descr, UINT overflowsize, UINT proto_rsvd_length)
 {
 	struct ndis_packet_pool *pool;
+	struct ndis_packet *packet;
+	UINT i, n;
 
 	ENTER3("buffers: %d, length: %d", num_descr, proto_rsvd_length);
 	pool = kzalloc(sizeof(*pool), irql_gfp());
@@ -1454,15 +1590,35 @@ wstdcall void WIN_FUNC(NdisAllocatePacketPoolEx,5)
 		*status = NDIS_STATUS_RESOURCES;
 		EXIT3(return);
 	}
+	pool->magazines = alloc_percpu(struct ndis_packet_magazine);
+	if (!pool->magazines) {
+		kfree(pool);
+		*status = NDIS_STATUS_RESOURCES;
+		EXIT3(return);
+	}
 	spin_lock_init(&pool->lock);
 	pool->max_descr = num_descr;
-	pool->num_allocated_descr = 0;
-	pool->num_used_descr = 0;
 	pool->free_descr = NULL;
 	pool->proto_rsvd_length = proto_rsvd_length;
+	/* packet has space for 1 byte in protocol_reserved field */
+	pool->packet_length = sizeof(*packet) - 1 + proto_rsvd_length +
+		sizeof(struct ndis_packet_oob_data);
+	/* some drivers ask for very large pools; beyond
+	 * MAX_PREALLOCATED_NDIS_PACKETS, packets are allocated as
+	 * needed */
+	n = min_t(UINT, num_descr, MAX_PREALLOCATED_NDIS_PACKETS);
+	for (i = 0; i < n; i++) {
+		packet = kmalloc(pool->packet_length, irql_gfp());
+		if (!packet)
+			break;
+		packet->reserved[0] =
+			(typeof(packet->reserved[0]))pool->free_descr;
+		pool->free_descr = packet;
+	}
+	pool->num_allocated_descr = i;
 	*pool_handle = pool;
 	*status = NDIS_STATUS_SUCCESS;
-	TRACE3("pool: %p", pool);
+	TRACE3("pool: %p, %d", pool, i);
 	EXIT3(return);
 }
 
@@ -1478,13 +1634,21 @@ wstdcall void WIN_FUNC(NdisAllocatePacketPool,4)
 wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 	(struct ndis_packet_pool *pool)
 {
+	struct ndis_packet_magazine *mag;
 	struct ndis_packet *packet, *next;
+	int cpu;
 
 	ENTER3("pool: %p", pool);
 	if (!pool) {
 		WARNING("invalid pool");
 		EXIT3(return);
 	}
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(pool->magazines, cpu);
+		while (mag->count > 0)
+			kfree(mag->packets[--mag->count]);
+	}
+	free_percpu(pool->magazines);
 	spin_lock_bh(&pool->lock);
 	packet = pool->free_descr;
 	while (packet) {
@@ -1493,7 +1657,6 @@ wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 		packet = next;
 	}
 	pool->num_allocated_descr = 0;
-	pool->num_used_descr = 0;
 	pool->free_descr = NULL;
 	spin_unlock_bh(&pool->lock);
 	kfree(pool);
@@ -1503,15 +1666,23 @@ wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 wstdcall UINT WIN_FUNC(NdisPacketPoolUsage,1)
 	(struct ndis_packet_pool *pool)
 {
-	EXIT4(return pool->num_used_descr);
+	int cpu, used;
+
+	used = 0;
+	for_each_possible_cpu(cpu)
+		used += per_cpu_ptr(pool->magazines, cpu)->used;
+	/* counts are read without synchronization */
+	if (used < 0)
+		used = 0;
+	EXIT4(return used);
 }
 
 wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 	(NDIS_STATUS *status, struct ndis_packet **ndis_packet,
 	 struct ndis_packet_pool *pool)
 {
+	struct ndis_packet_magazine *mag;
 	struct ndis_packet *packet;
-	int packet_length;
 
 	ENTER4("pool: %p", pool);
 	if (!pool) {
@@ -1520,37 +1691,49 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 		EXIT4(return);
 	}
 	assert_irql(_irql_ <= SOFT_LEVEL);
-	if (pool->num_used_descr > pool->max_descr) {
-		TRACE3("pool %p is full: %d(%d)", pool,
-		       pool->num_used_descr, pool->max_descr);
+	local_bh_disable();
+	mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+	if (unlikely(mag->count == 0))
+		packet_magazine_refill(pool, mag);
+	if (likely(mag->count > 0)) {
+		packet = mag->packets[--mag->count];
+		mag->used++;
+	} else
+		packet = NULL;
+	local_bh_enable();
+	if (!packet) {
+		/* free packets may be cached on other cpus */
+		if (NdisPacketPoolUsage(pool) >= pool->max_descr) {
+			TRACE3("pool %p is full: %d(%d)", pool,
+			       NdisPacketPoolUsage(pool), pool->max_descr);
 #ifndef ALLOW_POOL_OVERFLOW
-		*status = NDIS_STATUS_RESOURCES;
-		*ndis_packet = NULL;
-		return;
+			*status = NDIS_STATUS_RESOURCES;
+			*ndis_packet = NULL;
+			return;
 #endif
-	}
-	/* packet has space for 1 byte in protocol_reserved field */
-	packet_length = sizeof(*packet) - 1 + pool->proto_rsvd_length +
-		sizeof(struct ndis_packet_oob_data);
-	spin_lock_bh(&pool->lock);
-	if ((packet = pool->free_descr))
-		pool->free_descr = (void *)packet->reserved[0];
-	spin_unlock_bh(&pool->lock);
-	if (!packet) {
-		packet = kmalloc(packet_length, irql_gfp());
+		}
+		packet = kmalloc(pool->packet_length, irql_gfp());
 		if (!packet) {
 			WARNING("couldn't allocate packet");
 			*status = NDIS_STATUS_RESOURCES;
 			*ndis_packet = NULL;
 			return;
 		}
-		atomic_inc_var(pool->num_allocated_descr);
+		local_bh_disable();
+		spin_lock(&pool->lock);
+		pool->num_allocated_descr++;
+		spin_unlock(&pool->lock);
+		per_cpu_ptr(pool->magazines, smp_processor_id())->used++;
+		local_bh_enable();
 	}
 	TRACE4("%p, %p", pool, packet);
-	atomic_inc_var(pool->num_used_descr);
-	memset(packet, 0, packet_length);
+	/* only header and OOB data need to be cleared; protocol
+	 * reserved area is for the owner of the pool */
+	memset(packet, 0, offsetof(struct ndis_packet, protocol_reserved));
 	packet->private.oob_offset =
-		packet_length - sizeof(struct ndis_packet_oob_data);
+		pool->packet_length - sizeof(struct ndis_packet_oob_data);
+	memset((char *)packet + packet->private.oob_offset, 0,
+	       sizeof(struct ndis_packet_oob_data));
 	packet->private.packet_flags = fPACKET_ALLOCATED_BY_NDIS;
 	packet->private.pool = pool;
 	*ndis_packet = packet;
@@ -1568,6 +1751,7 @@ wstdcall void WIN_FUNC(NdisDprAllocatePacket,3)
 wstdcall void WIN_FUNC(NdisFreePacket,1)
 	(struct ndis_packet *packet)
 {
+	struct ndis_packet_magazine *mag;
 	struct ndis_packet_pool *pool;
 
 	ENTER4("%p, %p", packet, packet->private.pool);
@@ -1576,25 +1760,19 @@ wstdcall void WIN_FUNC(NdisFreePacket,1)
 		ERROR("invalid pool %p", packet);
 		EXIT4(return);
 	}
-	assert((int)pool->num_used_descr > 0);
-	atomic_dec_var(pool->num_used_descr);
 	if (packet->reserved[1]) {
 		TRACE3("%p, %p", packet, (void *)packet->reserved[1]);
 		kfree((void *)packet->reserved[1]);
 		packet->reserved[1] = 0;
 	}
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_PACKETS) {
-		TRACE3("%p", pool);
-		atomic_dec_var(pool->num_allocated_descr);
-		kfree(packet);
-	} else {
-		TRACE4("%p, %p, %p", pool, packet, pool->free_descr);
-		spin_lock_bh(&pool->lock);
-		packet->reserved[0] =
-			(typeof(packet->reserved[0]))pool->free_descr;
-		pool->free_descr = packet;
-		spin_unlock_bh(&pool->lock);
-	}
+	local_bh_disable();
+	mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+	mag->used--;
+	if (unlikely(mag->count == PACKET_MAGAZINE_SIZE))
+		packet_magazine_flush(pool, mag);
+	mag->packets[mag->count++] = packet;
+	TRACE4("%p, %p, %u", pool, packet, mag->count);
+	local_bh_enable();
 	EXIT4(return);
 }
 
@@ -1801,11 +1979,11 @@ wstdcall void WIN_FUNC(NdisMInitializeTimer,4)
 wstdcall void WIN_FUNC(NdisMSetPeriodicTimer,2)
 	(struct ndis_mp_timer *timer, UINT period_ms)
 {
-	unsigned long expires = MSEC_TO_HZ(period_ms);
+	u64 period = (u64)period_ms * TICKSPERMSEC;
 
-	TIMERENTER("%p, %u, %ld", timer, period_ms, expires);
+	TIMERENTER("%p, %u", timer, period_ms);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
-	wrap_set_timer(&timer->nt_timer, expires, expires, &timer->kdpc);
+	wrap_set_timer(&timer->nt_timer, period, period, &timer->kdpc);
 	TIMEREXIT(return);
 }
 
@@ -1835,12 +2013,11 @@ wstdcall void WIN_FUNC(NdisInitializeTimer,3)
 wstdcall void WIN_FUNC(NdisSetTimer,2)
 	(struct ndis_timer *timer, UINT duetime_ms)
 {
-	unsigned long expires = MSEC_TO_HZ(duetime_ms);
-
-	TIMERENTER("%p, %p, %u, %ld", timer, timer->nt_timer.wrap_timer,
-		   duetime_ms, expires);
+	TIMERENTER("%p, %p, %u", timer, timer->nt_timer.wrap_timer,
+		   duetime_ms);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
-	wrap_set_timer(&timer->nt_timer, expires, 0, &timer->kdpc);
+	wrap_set_timer(&timer->nt_timer, (u64)duetime_ms * TICKSPERMSEC, 0,
+		       &timer->kdpc);
 	TIMEREXIT(return);
 }
 
@@ -1870,6 +2047,38 @@ wstdcall void WIN_FUNC(NdisMDeregisterAdapterShutdownHandler,1)
 	wnd->shutdown_ctx = NULL;
 }
 
+/* interrupt-to-DPC latency of irq_kdpc; stamp is taken by ISR for
+ * the first interrupt not yet handled and accounted for when
+ * irq_kdpc starts */
+static void irq_latency_stamp(struct ndis_device *wnd)
+{
+	unsigned long now;
+
+	now = (unsigned long)ktime_to_ns(ktime_get());
+	if (unlikely(now == 0))
+		now = 1;
+	cmpxchg(&wnd->irq_stamp, 0, now);
+}
+
+static void irq_latency_account(struct ndis_device *wnd)
+{
+	unsigned long stamp, usecs;
+	int i;
+
+	stamp = xchg(&wnd->irq_stamp, 0);
+	if (!stamp)
+		return;
+	usecs = ((unsigned long)ktime_to_ns(ktime_get()) - stamp) / 1000;
+	if (usecs > wnd->irq_latency_max)
+		wnd->irq_latency_max = usecs;
+	if (usecs >= (1 << (IRQ_LATENCY_HIST_SIZE - 2)))
+		i = IRQ_LATENCY_HIST_SIZE - 1;
+	else
+		i = fls(usecs);
+	wnd->irq_latency_hist[i]++;
+	wnd->irq_dpc_count++;
+}
+
 /* TODO: rt61 (serialized) driver doesn't want MiniportEnableInterrupt
  * to be called in irq handler, but mrv800c (deserialized) driver
  * wants. NDIS is confusing about when to call MiniportEnableInterrupt
@@ -1885,9 +2094,11 @@ wstdcall void deserialized_irq_handler(struct kdpc *kdpc, void *ctx,
 
 	TRACE6("%p", irq_handler);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
+	irq_latency_account(wnd);
 	LIN2WIN1(irq_handler, wnd->nmb->mp_ctx);
 	if (mp->enable_interrupt)
 		LIN2WIN1(mp->enable_interrupt, wnd->nmb->mp_ctx);
+	ndis_rx_flush(wnd);
 	EXIT6(return);
 }
 WIN_FUNC_DECL(deserialized_irq_handler,4)
@@ -1900,9 +2111,11 @@ wstdcall void serialized_irq_handler(struct kdpc *kdpc, void *ctx,
 
 	TRACE6("%p, %p, %p", wnd, irq_handler, arg2);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
+	irq_latency_account(wnd);
 	serialize_lock(wnd);
 	LIN2WIN1(irq_handler, arg2);
 	serialize_unlock(wnd);
+	ndis_rx_flush(wnd);
 	EXIT6(return);
 }
 WIN_FUNC_DECL(serialized_irq_handler,4)
@@ -1930,7 +2143,8 @@ wstdcall BOOLEAN ndis_isr(struct kinterrupt *kinterrupt, void *ctx)
 	if (recognized) {
 		if (queue_handler) {
 			TRACE5("%p", &wnd->irq_kdpc);
-			queue_kdpc(&wnd->irq_kdpc);
+			irq_latency_stamp(wnd);
+			queue_interrupt_dpc(kinterrupt, &wnd->irq_kdpc);
 		}
 		EXIT6(return TRUE);
 	}
@@ -1983,15 +2197,26 @@ wstdcall NDIS_STATUS WIN_FUNC(NdisMRegisterInterrupt,7)
 		       nmb->wnd);
 	}
 
-	if (IoConnectInterrupt(&mp_interrupt->kinterrupt,
-			       WIN_FUNC_PTR(ndis_isr,2), mp_interrupt, NULL,
-			       vector, DIRQL, DIRQL, mode, shared, 0, FALSE) !=
+	wnd->irq_thread = 0;
+	if (ndis_get_setting_int(wnd, "irq_thread", irq_thread)) {
+#ifdef WRAP_IRQ_THREAD
+		wnd->irq_thread = 1;
+#else
+		WARNING("%s: irq_thread is not supported by this kernel",
+			wnd->wd->driver->name);
+#endif
+	}
+	if (connect_interrupt(&mp_interrupt->kinterrupt,
+			      WIN_FUNC_PTR(ndis_isr,2), mp_interrupt, NULL,
+			      vector, DIRQL, DIRQL, mode, shared, 0, FALSE,
+			      wnd->irq_thread ? &wnd->irq_kdpc : NULL) !=
 	    STATUS_SUCCESS) {
 		printk(KERN_WARNING "%s: request for IRQ %d failed\n",
 		       DRIVER_NAME, vector);
 		return NDIS_STATUS_RESOURCES;
 	}
-	printk(KERN_INFO "%s: using IRQ %d\n", DRIVER_NAME, vector);
+	printk(KERN_INFO "%s: using IRQ %d%s\n", DRIVER_NAME, vector,
+	       wnd->irq_thread ? " (threaded)" : "");
 	EXIT1(return NDIS_STATUS_SUCCESS);
 }
 
@@ -2166,7 +2391,7 @@ wstdcall void WIN_FUNC(NdisMIndicateStatusComplete,1)
 	struct ndis_device *wnd = nmb->wnd;
 	ENTER2("%p", wnd);
 	if (wnd->tx_ok)
-		queue_work(wrapndis_wq, &wnd->tx_work);
+		queue_work(wrapndis_tx_wq, &wnd->tx_work);
 }
 
 /* called via function pointer */
@@ -2199,8 +2424,8 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 		 * MiniportSend(Packets), wakeup tx worker now.
 		 */
 		if (xchg(&wnd->tx_ok, 1) == 0) {
-			TRACE3("%d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
-			queue_work(wrapndis_wq, &wnd->tx_work);
+			TRACE3("%u, %u", wnd->tx_ring_cons, wnd->tx_ring_prod);
+			queue_work(wrapndis_tx_wq, &wnd->tx_work);
 		}
 	}
 	EXIT3(return);
@@ -2210,30 +2435,120 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 wstdcall void NdisMSendResourcesAvailable(struct ndis_mp_block *nmb)
 {
 	struct ndis_device *wnd = nmb->wnd;
-	ENTER3("%d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
+	ENTER3("%u, %u", wnd->tx_ring_cons, wnd->tx_ring_prod);
 	wnd->tx_ok = 1;
-	queue_work(wrapndis_wq, &wnd->tx_work);
+	queue_work(wrapndis_tx_wq, &wnd->tx_work);
 	EXIT3(return);
 }
 
-wstdcall void return_packet(void *arg1, void *arg2)
+/* packets received from deserialized drivers are returned to the
+ * driver in batches from return_packet_worker; until then they are
+ * kept in rx_return_list, linked through reserved[0], which is used
+ * by packet pools only for free packets */
+
+/* any number of callers may add packets at the same time */
+static void queue_return_packet(struct ndis_device *wnd,
+				struct ndis_packet *packet)
 {
-	struct ndis_device *wnd;
-	struct ndis_packet *packet;
+	struct ndis_packet *head;
+
+	do {
+		head = ACCESS_ONCE(wnd->rx_return_list);
+		packet->reserved[0] = (typeof(packet->reserved[0]))head;
+	} while (cmpxchg(&wnd->rx_return_list, head, packet) != head);
+	/* if list was not empty, worker is already queued */
+	if (!head)
+		queue_work(wrapndis_wq, &wnd->rx_return_work);
+}
+
+void ndis_return_packets(struct ndis_device *wnd)
+{
+	struct ndis_packet *packet, *next, *list;
 	struct miniport *mp;
 	KIRQL irql;
+	int n;
 
-	wnd = arg1;
-	packet = arg2;
-	ENTER4("%p, %p", wnd, packet);
+	packet = xchg(&wnd->rx_return_list, NULL);
+	if (!packet)
+		return;
+	/* once driver is halted, its packet pools are gone; packets
+	 * it indicated while being halted are just forgotten */
+	if (!test_bit(HW_INITIALIZED, &wnd->wd->hw_status)) {
+		TRACE1("%p: dropping returned packets", wnd);
+		return;
+	}
+	/* packets were added at the head; return them in the order
+	 * they were received */
+	list = NULL;
+	while (packet) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		packet->reserved[0] = (typeof(packet->reserved[0]))list;
+		list = packet;
+		packet = next;
+	}
 	mp = &wnd->wd->driver->ndis_driver->mp;
+	n = 0;
 	irql = serialize_lock_irql(wnd);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
-	LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+	for (packet = list; packet; packet = next) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		packet->reserved[0] = 0;
+		LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+		n++;
+	}
 	serialize_unlock_irql(wnd, irql);
-	EXIT4(return);
+	TRACE4("%p, %d", wnd, n);
+}
+
+static void return_packet_worker(struct work_struct *work)
+{
+	struct ndis_device *wnd;
+
+	wnd = container_of(work, struct ndis_device, rx_return_work);
+	WORKENTER("%p", wnd);
+	ndis_return_packets(wnd);
+	WORKEXIT(return);
+}
+
+/* received skbs are queued to rx_queue and passed to network stack
+ * from ndis_napi_poll; poll is scheduled when the driver is done
+ * indicating packets (EthRxComplete, end of interrupt DPC), or when
+ * the queue has enough packets for a poll */
+static void rx_skb(struct ndis_device *wnd, struct sk_buff *skb)
+{
+#ifdef WRAP_NAPI
+	if (likely(netif_running(wnd->net_dev))) {
+		if (unlikely(skb_queue_len(&wnd->rx_queue) >=
+			     MAX_RX_QUEUE_LEN)) {
+			atomic_inc_var(wnd->net_stats.rx_dropped);
+			dev_kfree_skb_any(skb);
+			return;
+		}
+		skb_queue_tail(&wnd->rx_queue, skb);
+		if (skb_queue_len(&wnd->rx_queue) >= wnd->napi.weight)
+			ndis_rx_flush(wnd);
+		return;
+	}
+#endif
+	if (in_interrupt())
+		netif_rx(skb);
+	else
+		netif_rx_ni(skb);
+}
+
+void ndis_rx_flush(struct ndis_device *wnd)
+{
+#ifdef WRAP_NAPI
+	if (!skb_queue_empty(&wnd->rx_queue)) {
+		/* DPCs run in process context; bottom halves are
+		 * disabled so that pending softirq runs when they
+		 * are enabled */
+		local_bh_disable();
+		napi_schedule(&wnd->napi);
+		local_bh_enable();
+	}
+#endif
 }
-WIN_FUNC_DECL(return_packet,2)
 
 /* called via function pointer */
 wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
@@ -2267,6 +2582,16 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 		oob_data = NDIS_PACKET_OOB_DATA(packet);
 		TRACE3("0x%x, 0x%x, %llu", packet->private.flags,
 		       packet->private.packet_flags, oob_data->time_rxed);
+		/* start fetching next packet's data while this one
+		 * is copied */
+		if (i + 1 < nr_packets && packets[i + 1] &&
+		    packets[i + 1]->private.buffer_head)
+			prefetch(MmGetSystemAddressForMdl(
+					 packets[i + 1]->private.buffer_head));
+		/* data is copied, as miniport's buffers can't be
+		 * attached to skb: skb destructor runs when the stack
+		 * orphans skb, long before data is consumed, and the
+		 * buffers may lack usable page reference counts */
 		skb = dev_alloc_skb(total_length);
 		if (skb) {
 			while (buffer) {
@@ -2288,10 +2613,7 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 			else
 				skb->ip_summed = CHECKSUM_NONE;
 
-			if (in_interrupt())
-				netif_rx(skb);
-			else
-				netif_rx_ni(skb);
+			rx_skb(wnd, skb);
 		} else {
 			WARNING("couldn't allocate skb; packet dropped");
 			atomic_inc_var(wnd->net_stats.rx_dropped);
@@ -2317,9 +2639,9 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 		 * MiniportReturnPacket from here is not correct - the
 		 * driver doesn't expect it (at least Centrino driver
 		 * crashes) */
-		schedule_ntos_work_item(WIN_FUNC_PTR(return_packet,2),
-					wnd, packet);
+		queue_return_packet(wnd, packet);
 	}
+	ndis_rx_flush(wnd);
 	EXIT3(return);
 }
 
@@ -2434,10 +2756,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 		skb->protocol = eth_type_trans(skb, wnd->net_dev);
 		pre_atomic_add(wnd->net_stats.rx_bytes, skb_size);
 		atomic_inc_var(wnd->net_stats.rx_packets);
-		if (in_interrupt())
-			netif_rx(skb);
-		else
-			netif_rx_ni(skb);
+		rx_skb(wnd, skb);
 	}
 
 	EXIT3(return);
@@ -2497,16 +2816,15 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	else
 		skb->ip_summed = CHECKSUM_NONE;
 
-	if (in_interrupt())
-		netif_rx(skb);
-	else
-		netif_rx_ni(skb);
+	rx_skb(wnd, skb);
+	ndis_rx_flush(wnd);
 }
 
 /* called via function pointer */
 wstdcall void EthRxComplete(struct ndis_mp_block *nmb)
 {
 	TRACE3("");
+	ndis_rx_flush(nmb->wnd);
 }
 
 /* called via function pointer */
@@ -2956,6 +3274,8 @@ int ndis_init_device(struct ndis_device *wnd)
 
 	KeInitializeSpinLock(&nmb->lock);
 	wnd->mp_interrupt = NULL;
+	wnd->rx_return_list = NULL;
+	INIT_WORK(&wnd->rx_return_work, return_packet_worker);
 	wnd->wrap_timer_slist.next = NULL;
 	if (wnd->wd->driver->ndis_driver)
 		wnd->wd->driver->ndis_driver->mp.shutdown = NULL;
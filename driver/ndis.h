@@ -72,10 +72,21 @@ struct ndis_phy_addr_unit {
 typedef struct mdl ndis_buffer;
 
 struct ndis_buffer_pool {
-	ndis_buffer *free_descr;
-//	NT_SPIN_LOCK lock;
-	spinlock_t lock;
+	/* 1 + index of first free descriptor in descr in low 32
+	 * bits (0 if none is free), and a count in high 32 bits
+	 * that is incremented when a descriptor is taken, so it can
+	 * be updated with cmpxchg64 */
+	u64 free_head;
+	/* MDL_CACHE_SIZE descriptors, with next_descr[i] being 1 +
+	 * index of the free descriptor after descr[i] */
+	char *descr;
+	u32 *next_descr;
+	UINT num_descr;
 	UINT max_descr;
+	/* descriptors in descr that are in use */
+	UINT num_used_descr;
+	/* descriptors allocated when descr is exhausted, or for
+	 * buffers that span more than MDL_CACHE_PAGES */
 	UINT num_allocated_descr;
 };
 
@@ -206,14 +217,26 @@ struct ndis_task_tcp_large_send {
 
 struct ndis_packet;
 
+#define PACKET_MAGAZINE_SIZE 32
+
+/* per-cpu cache of free packet descriptors */
+struct ndis_packet_magazine {
+	unsigned int count;
+	/* packets allocated less packets freed on this cpu */
+	int used;
+	struct ndis_packet *packets[PACKET_MAGAZINE_SIZE];
+};
+
 struct ndis_packet_pool {
+	/* descriptors not in any magazine, linked through reserved[0] */
 	struct ndis_packet *free_descr;
 //	NT_SPIN_LOCK lock;
 	spinlock_t lock;
 	UINT max_descr;
 	UINT num_allocated_descr;
-	UINT num_used_descr;
 	UINT proto_rsvd_length;
+	UINT packet_length;
+	struct ndis_packet_magazine *magazines;
 };
 
 struct ndis_packet_stack {
@@ -286,6 +309,8 @@ struct ndis_packet_oob_data {
 		/* used for tx only */
 		struct {
 			struct sk_buff *tx_skb;
+			/* next packet in tx_resend list */
+			struct ndis_packet *tx_next;
 			union {
 				struct wrap_tx_sg_list wrap_tx_sg_list;
 				struct ndis_sg_list *tx_sg_list;
@@ -838,6 +863,16 @@ struct ndis_mp_block {
 	struct ndis_device *wnd;
 };
 
+#define TX_BATCH_HIST_SIZE 5
+/* interrupt-to-DPC latency buckets: <1us, <2us, <4us, ..., >=1024us */
+#define IRQ_LATENCY_HIST_SIZE 12
+
+/* received packets are passed to network stack from NAPI poll, with
+ * GRO */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define WRAP_NAPI 1
+#endif
+
 struct ndis_device {
 	struct ndis_mp_block *nmb;
 	struct wrap_device *wd;
@@ -845,6 +880,14 @@ struct ndis_device {
 	void *shutdown_ctx;
 	struct ndis_mp_interrupt *mp_interrupt;
 	struct kdpc irq_kdpc;
+	/* irq_kdpc is run by irq thread instead of kdpc_wq */
+	u8 irq_thread;
+	/* time (in ns) of earliest interrupt not yet handled by
+	 * irq_kdpc, or 0 */
+	unsigned long irq_stamp;
+	unsigned long irq_dpc_count;
+	unsigned long irq_latency_max;
+	unsigned long irq_latency_hist[IRQ_LATENCY_HIST_SIZE];
 	unsigned long mem_start;
 	unsigned long mem_end;
 
@@ -854,14 +897,51 @@ struct ndis_device {
 	struct ndis_wireless_stats ndis_stats;
 
 	struct work_struct tx_work;
-	struct ndis_packet *tx_ring[TX_RING_SIZE];
-	u8 tx_ring_start;
-	u8 tx_ring_end;
-	u8 is_tx_ring_full;
+	/* tx_ring is filled by tx_skbuff without locks: a producer
+	 * claims a slot by advancing tx_ring_prod with cmpxchg and
+	 * then publishes the packet in that slot; tx_worker (holding
+	 * tx_ring_mutex) consumes published slots, clears them and
+	 * advances tx_ring_cons */
+	struct ndis_packet **tx_ring;
+	unsigned int tx_ring_size;
+	unsigned int tx_ring_mask;
+	/* queue is stopped when free slots drop below tx_ring_stop
+	 * and woken up when they are back at tx_ring_wake */
+	unsigned int tx_ring_stop;
+	unsigned int tx_ring_wake;
+	unsigned int tx_ring_prod ____cacheline_aligned_in_smp;
+	unsigned int tx_ring_cons ____cacheline_aligned_in_smp;
 	u8 tx_ok;
-	spinlock_t tx_ring_lock;
 	struct mutex tx_ring_mutex;
 	unsigned int max_tx_packets;
+	/* packets gathered from tx_ring for MiniportSendPackets */
+	struct ndis_packet *tx_array[MAX_TX_PACKETS];
+	/* batches passed to MiniportSendPackets, by size: 1, 2-3,
+	 * 4-7, 8-15, 16 or more packets; updated by tx_worker only */
+	unsigned long tx_batch_hist[TX_BATCH_HIST_SIZE];
+	unsigned long tx_batch_packets;
+	/* send packets to deserialized drivers from tx_skbuff */
+	u8 tx_direct;
+	u8 tx_direct_stalled;
+	unsigned long tx_direct_packets;
+	unsigned long tx_direct_requeued;
+	/* packets completed with NDIS_STATUS_RESOURCES, oldest first;
+	 * tx_worker resends them before anything in tx_ring */
+	spinlock_t tx_resend_lock;
+	struct ndis_packet *tx_resend_head;
+	struct ndis_packet *tx_resend_tail;
+	struct timer_list tx_retry_timer;
+	/* received packets to be returned to deserialized driver */
+	struct ndis_packet *rx_return_list;
+	struct work_struct rx_return_work;
+#ifdef WRAP_NAPI
+	struct napi_struct napi;
+	/* received skbs not yet taken by ndis_napi_poll */
+	struct sk_buff_head rx_queue;
+	/* skbs taken from rx_queue by ndis_napi_poll, not yet passed
+	 * to network stack; used only in ndis_napi_poll */
+	struct sk_buff_head rx_poll_queue;
+#endif
 	struct mutex ndis_req_mutex;
 	struct task_struct *ndis_req_task;
 	int ndis_req_done;
@@ -904,6 +984,8 @@ struct ndis_device {
 	enum ndis_physical_medium physical_medium;
 	ULONG ndis_wolopts;
 	struct nt_slist wrap_timer_slist;
+	/* slack (in usec) of periodic timers */
+	int timer_slack;
 	int drv_ndis_version;
 	struct ndis_pnp_capabilities pnp_capa;
 };
@@ -914,9 +996,12 @@ int ndis_init(void);
 void ndis_exit(void);
 int ndis_init_device(struct ndis_device *wnd);
 void ndis_exit_device(struct ndis_device *wnd);
+int ndis_get_setting_int(struct ndis_device *wnd, const char *name, int def);
 
 int wrap_procfs_add_ndis_device(struct ndis_device *wnd);
 void wrap_procfs_remove_ndis_device(struct ndis_device *wnd);
+void ndis_rx_flush(struct ndis_device *wnd);
+void ndis_return_packets(struct ndis_device *wnd);
 
 void NdisAllocatePacketPoolEx(NDIS_STATUS *status,
 			      struct ndis_packet_pool **pool_handle,
@@ -926,6 +1011,7 @@ void NdisFreePacketPool(struct ndis_packet_pool *pool) wstdcall;
 void NdisAllocatePacket(NDIS_STATUS *status, struct ndis_packet **packet,
 			struct ndis_packet_pool *pool) wstdcall;
 void NdisFreePacket(struct ndis_packet *descr) wstdcall;
+UINT NdisPacketPoolUsage(struct ndis_packet_pool *pool) wstdcall;
 void NdisAllocateBufferPool(NDIS_STATUS *status,
 			    struct ndis_buffer_pool **pool_handle,
 			    UINT num_descr) wstdcall;
@@ -1306,4 +1392,18 @@ static inline void if_serialize_unlock(struct ndis_device *wnd)
 		nt_spin_unlock(&wnd->nmb->lock);
 }
 
+/* number of packets in tx_ring; consumer index is read first so the
+ * result never underflows */
+static inline unsigned int tx_ring_used(struct ndis_device *wnd)
+{
+	unsigned int cons = ACCESS_ONCE(wnd->tx_ring_cons);
+	smp_rmb();
+	return ACCESS_ONCE(wnd->tx_ring_prod) - cons;
+}
+
+static inline unsigned int tx_ring_free(struct ndis_device *wnd)
+{
+	return wnd->tx_ring_size - tx_ring_used(wnd);
+}
+
 #endif /* NDIS_H */
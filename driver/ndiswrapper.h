@@ -25,7 +25,17 @@
 #define NDIS_ESSID_MAX_SIZE 32
 #define NDIS_ENCODING_TOKEN_MAX 32
 #define MAX_ENCR_KEYS 4
-#define TX_RING_SIZE 16
+/* maximum number of packets passed to MiniportSendPackets at once */
+#define MAX_TX_PACKETS 16
+/* TX ring size must be a power of 2 */
+#define MIN_TX_RING_SIZE 16
+#define DEFAULT_TX_RING_SIZE 256
+#define MAX_TX_RING_SIZE 4096
+/* maximum number of packets passed to network stack in one NAPI poll */
+#define DEFAULT_NAPI_WEIGHT 64
+#define MAX_NAPI_WEIGHT 256
+/* received packets waiting for NAPI poll beyond this are dropped */
+#define MAX_RX_QUEUE_LEN 1024
 #define NDIS_MAX_RATES 8
 #define NDIS_MAX_RATES_EX 16
 
@@ -57,8 +67,6 @@
 #define MAX_DRIVER_BIN_FILES 5
 #define MAX_DEVICE_SETTINGS 512
 
-#define MAX_ALLOCATED_URBS 15
-
 #define DEV_ANY_ID -1
 
 #define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
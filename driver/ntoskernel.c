@@ -19,6 +19,8 @@
 #include "pnp.h"
 #include "loader.h"
 #include "ntoskernel_exports.h"
+#include "wrapper.h"
+#include <linux/hash.h>
 
 /* MDLs describe a range of virtual address with an array of physical
  * pages right after the header. For different ranges of virtual
@@ -29,30 +31,57 @@
  * requests an MDL for a bigger region, we allocate it with kmalloc;
  * otherwise, we allocate from the pool */
 
-#define MDL_CACHE_PAGES 3
-#define MDL_CACHE_SIZE (sizeof(struct mdl) + \
-			(sizeof(PFN_NUMBER) * MDL_CACHE_PAGES))
 struct wrap_mdl {
 	struct nt_list list;
 	struct mdl mdl[0];
 };
 
 /* everything here is for all drivers/devices - not per driver/device */
-static spinlock_t dispatcher_lock;
 spinlock_t ntoskernel_lock;
 static void *mdl_cache;
 static struct nt_list wrap_mdl_list;
+static spinlock_t wrap_mdl_lock;
+
+/* dispatcher objects (events, mutexes etc.) are protected by one of
+ * dispatcher_locks, chosen by hash of the object's address, so that
+ * unrelated objects don't contend; a thread waiting on multiple
+ * objects takes locks of all of them, in order of index. The number
+ * of locks bounds how many a waiter holds at once, which must stay
+ * well below lockdep's MAX_LOCK_DEPTH (48) */
+#define DISPATCHER_LOCK_HASH_BITS 4
+#define DISPATCHER_LOCKS (1 << DISPATCHER_LOCK_HASH_BITS)
+static spinlock_t dispatcher_locks[DISPATCHER_LOCKS];
+/* each lock gets its own class so lockdep doesn't complain when a
+ * waiter takes more than one of them */
+static struct lock_class_key dispatcher_lock_keys[DISPATCHER_LOCKS];
+static inline spinlock_t *dispatcher_lock(struct dispatcher_header *dh);
+static void object_signaled(struct dispatcher_header *dh);
+
+/* DPCs are queued to per-cpu queues, each drained by kdpc_wq's
+ * worker on that cpu, so that DPCs queued on different cpus (e.g.,
+ * from interrupts of different devices) run in parallel */
+struct kdpc_queue {
+	struct nt_list list;
+	spinlock_t lock;
+	struct work_struct work;
+};
 
-static struct work_struct kdpc_work;
-static void kdpc_worker(struct work_struct *dummy);
-
-static struct nt_list kdpc_list;
-static spinlock_t kdpc_list_lock;
+static DEFINE_PER_CPU(struct kdpc_queue, kdpc_queues);
+static struct workqueue_struct *kdpc_wq;
+static void kdpc_worker(struct work_struct *work);
 
 static struct nt_list callback_objects;
 
 struct nt_list object_list;
 
+/* threads are looked up by task (for KeGetCurrentThread etc.) and by
+ * thread (to validate thread pointers passed by drivers); lookups are
+ * under RCU, changes under ntoskernel_lock */
+#define NT_THREAD_HASH_BITS 6
+#define NT_THREAD_HASH_SIZE (1 << NT_THREAD_HASH_BITS)
+static struct nt_thread *nt_thread_task_hash[NT_THREAD_HASH_SIZE];
+static struct nt_thread *nt_thread_hash[NT_THREAD_HASH_SIZE];
+
 struct bus_driver {
 	struct nt_list list;
 	char name[MAX_DRIVER_NAME_LEN];
@@ -61,10 +90,11 @@ struct bus_driver {
 
 static struct nt_list bus_driver_list;
 
-static struct work_struct ntos_work;
+DEFINE_PER_CPU(struct ntos_work_queue, ntos_work_queues);
+static struct workqueue_struct *ntos_work_wq;
 static struct nt_list ntos_work_list;
 static spinlock_t ntos_work_lock;
-static void ntos_work_worker(struct work_struct *dummy);
+static void ntos_work_worker(struct work_struct *work);
 spinlock_t irp_cancel_lock;
 static NT_SPIN_LOCK nt_list_lock;
 static struct nt_slist wrap_timer_slist;
@@ -88,6 +118,8 @@ struct workqueue_struct *ntos_wq;
 
 #ifdef WRAP_PREEMPT
 DEFINE_PER_CPU(struct irql_info, irql_info);
+#else
+DEFINE_PER_CPU(int, irql_count);
 #endif
 
 #if defined(CONFIG_X86_64)
@@ -131,18 +163,21 @@ void *allocate_object(ULONG size, enum common_object_type type,
 	hdr->type = type;
 	hdr->ref_count = 1;
 	spin_lock_bh(&ntoskernel_lock);
-	/* threads are looked up often (in KeWaitForXXX), so optimize
-	 * for fast lookups of threads */
-	if (type == OBJECT_TYPE_NT_THREAD)
-		InsertHeadList(&object_list, &hdr->list);
-	else
-		InsertTailList(&object_list, &hdr->list);
+	InsertTailList(&object_list, &hdr->list);
 	spin_unlock_bh(&ntoskernel_lock);
 	body = HEADER_TO_OBJECT(hdr);
 	TRACE3("allocated hdr: %p, body: %p", hdr, body);
 	return body;
 }
 
+static void nt_thread_hash_del(struct nt_thread *thread);
+
+static void free_nt_thread_rcu(struct rcu_head *rcu)
+{
+	struct nt_thread *thread = container_of(rcu, struct nt_thread, rcu);
+	ExFreePool(OBJECT_TO_HEADER(thread));
+}
+
 static void free_object(void *object)
 {
 	struct common_object_header *hdr;
@@ -150,8 +185,16 @@ static void free_object(void *object)
 	hdr = OBJECT_TO_HEADER(object);
 	spin_lock_bh(&ntoskernel_lock);
 	RemoveEntryList(&hdr->list);
+	if (hdr->type == OBJECT_TYPE_NT_THREAD)
+		nt_thread_hash_del(object);
 	spin_unlock_bh(&ntoskernel_lock);
 	TRACE3("freed hdr: %p, body: %p", hdr, object);
+	/* threads (which have no names) may still be being looked up */
+	if (hdr->type == OBJECT_TYPE_NT_THREAD) {
+		call_rcu(&((struct nt_thread *)object)->rcu,
+			 free_nt_thread_rcu);
+		return;
+	}
 	if (hdr->name.buf)
 		ExFreePool(hdr->name.buf);
 	ExFreePool(hdr);
@@ -407,6 +450,77 @@ static void initialize_object(struct dispatcher_header *dh, enum dh_type type,
 	InitializeListHead(&dh->wait_blocks);
 }
 
+unsigned long timer_late_hist[TIMER_LATE_HIST_SIZE];
+unsigned long timer_late_max;
+
+#ifdef WRAP_HRTIMER
+
+static void timer_late_account(struct hrtimer *timer)
+{
+	unsigned long usecs;
+	s64 late;
+	int i;
+
+	late = ktime_to_us(ktime_sub(hrtimer_cb_get_time(timer),
+				     hrtimer_get_softexpires(timer)));
+	usecs = late > 0 ? late : 0;
+	if (usecs > timer_late_max)
+		timer_late_max = usecs;
+	if (usecs >= (1 << (TIMER_LATE_HIST_SIZE - 2)))
+		i = TIMER_LATE_HIST_SIZE - 1;
+	else
+		i = fls(usecs);
+	timer_late_hist[i]++;
+}
+
+/* runs in hard irq context */
+static enum hrtimer_restart timer_proc(struct hrtimer *timer)
+{
+	struct wrap_timer *wrap_timer;
+	struct nt_timer *nt_timer;
+	struct kdpc *kdpc;
+	enum hrtimer_restart ret;
+
+	wrap_timer = container_of(timer, struct wrap_timer, timer);
+	nt_timer = wrap_timer->nt_timer;
+	TIMERENTER("%p(%p), %lu", wrap_timer, nt_timer, jiffies);
+#ifdef TIMER_DEBUG
+	BUG_ON(wrap_timer->wrap_timer_magic != WRAP_TIMER_MAGIC);
+	BUG_ON(nt_timer->wrap_timer_magic != WRAP_TIMER_MAGIC);
+#endif
+	timer_late_account(timer);
+	/* same as KeSetEvent, except that waiters are woken by
+	 * wait_kdpc; see KeSetEvent about ordering */
+	if (xchg(&nt_timer->dh.signal_state, 1) == 0 &&
+	    !IsListEmpty(&nt_timer->dh.wait_blocks))
+		queue_kdpc(&wrap_timer->wait_kdpc);
+	if (wrap_timer->repeat) {
+		hrtimer_forward_now(timer, ns_to_ktime(wrap_timer->repeat));
+		ret = HRTIMER_RESTART;
+	} else
+		ret = HRTIMER_NORESTART;
+	kdpc = nt_timer->kdpc;
+	if (kdpc)
+		queue_kdpc(kdpc);
+	TIMEREXIT(return ret);
+}
+
+wstdcall void WIN_FUNC(timer_wait_dpc,4)
+	(struct kdpc *kdpc, void *ctx, void *arg1, void *arg2)
+{
+	struct nt_timer *nt_timer = ctx;
+	spinlock_t *lock;
+
+	lock = dispatcher_lock(&nt_timer->dh);
+	spin_lock_bh(lock);
+	if (nt_timer->dh.signal_state > 0)
+		object_signaled(&nt_timer->dh);
+	spin_unlock_bh(lock);
+}
+WIN_FUNC_DECL(timer_wait_dpc,4)
+
+#else
+
 static void timer_proc(unsigned long data)
 {
 	struct wrap_timer *wrap_timer = (struct wrap_timer *)data;
@@ -428,10 +542,15 @@ static void timer_proc(unsigned long data)
 	TIMEREXIT(return);
 }
 
+#endif
+
 void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 		     struct ndis_mp_block *nmb)
 {
 	struct wrap_timer *wrap_timer;
+#ifdef WRAP_HRTIMER
+	int slack;
+#endif
 
 	/* TODO: if a timer is initialized more than once, we allocate
 	 * memory for wrap_timer more than once for the same nt_timer,
@@ -452,9 +571,19 @@ void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 		return;
 	}
 
+#ifdef WRAP_HRTIMER
+	hrtimer_init(&wrap_timer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wrap_timer->timer.function = timer_proc;
+	KeInitializeDpc(&wrap_timer->wait_kdpc,
+			WIN_FUNC_PTR(timer_wait_dpc,4), nt_timer);
+	slack = nmb ? nmb->wnd->timer_slack : timer_slack;
+	if (slack > 0)
+		wrap_timer->slack = slack * NSEC_PER_USEC;
+#else
 	init_timer(&wrap_timer->timer);
 	wrap_timer->timer.data = (unsigned long)wrap_timer;
 	wrap_timer->timer.function = timer_proc;
+#endif
 	wrap_timer->nt_timer = nt_timer;
 #ifdef TIMER_DEBUG
 	wrap_timer->wrap_timer_magic = WRAP_TIMER_MAGIC;
@@ -490,14 +619,17 @@ wstdcall void WIN_FUNC(KeInitializeTimer,1)
 	wrap_init_timer(nt_timer, NotificationTimer, NULL);
 }
 
-/* expires and repeat are in HZ */
-BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
-		       unsigned long repeat_hz, struct kdpc *kdpc)
+/* expires and repeat are in 100ns ticks, relative to now */
+BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, u64 expires_ticks,
+		       u64 repeat_ticks, struct kdpc *kdpc)
 {
 	struct wrap_timer *wrap_timer;
+#ifdef WRAP_HRTIMER
+	unsigned long slack;
+#endif
 
-	TIMERENTER("%p, %lu, %lu, %p, %lu",
-		   nt_timer, expires_hz, repeat_hz, kdpc, jiffies);
+	TIMERENTER("%p, %llu, %llu, %p, %lu",
+		   nt_timer, expires_ticks, repeat_ticks, kdpc, jiffies);
 
 	wrap_timer = nt_timer->wrap_timer;
 	TIMERTRACE("%p", wrap_timer);
@@ -518,23 +650,61 @@ BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
 #endif
 	KeClearEvent((struct nt_event *)nt_timer);
 	nt_timer->kdpc = kdpc;
-	wrap_timer->repeat = repeat_hz;
-	if (mod_timer(&wrap_timer->timer, jiffies + expires_hz))
+#ifdef WRAP_HRTIMER
+	wrap_timer->repeat = repeat_ticks * 100;
+	/* only periodic timers are allowed to expire late, so they
+	 * can be coalesced with other timers */
+	if (wrap_timer->repeat)
+		slack = min_t(u64, wrap_timer->slack, wrap_timer->repeat / 2);
+	else
+		slack = 0;
+	if (hrtimer_start_range_ns(&wrap_timer->timer,
+				   ns_to_ktime(expires_ticks * 100), slack,
+				   HRTIMER_MODE_REL))
+		TIMEREXIT(return TRUE);
+	else
+		TIMEREXIT(return FALSE);
+#else
+	wrap_timer->repeat = SYSTEM_TIME_TO_HZ(-(s64)repeat_ticks);
+	if (mod_timer(&wrap_timer->timer,
+		      jiffies + SYSTEM_TIME_TO_HZ(-(s64)expires_ticks)))
 		TIMEREXIT(return TRUE);
 	else
 		TIMEREXIT(return FALSE);
+#endif
+}
+
+/* stop timer that is about to be freed; caller clears repeat first
+ * so periodic timer is not re-armed */
+int wrap_del_timer_sync(struct wrap_timer *wrap_timer)
+{
+#ifdef WRAP_HRTIMER
+	int ret;
+
+	ret = hrtimer_cancel(&wrap_timer->timer);
+	dequeue_kdpc(&wrap_timer->wait_kdpc);
+	return ret;
+#else
+	return del_timer_sync(&wrap_timer->timer);
+#endif
 }
 
 wstdcall BOOLEAN WIN_FUNC(KeSetTimerEx,4)
 	(struct nt_timer *nt_timer, LARGE_INTEGER duetime_ticks,
 	 LONG period_ms, struct kdpc *kdpc)
 {
-	unsigned long expires_hz, repeat_hz;
+	u64 expires_ticks, now;
 
 	TIMERENTER("%p, %lld, %d", nt_timer, duetime_ticks, period_ms);
-	expires_hz = SYSTEM_TIME_TO_HZ(duetime_ticks);
-	repeat_hz = MSEC_TO_HZ(period_ms);
-	return wrap_set_timer(nt_timer, expires_hz, repeat_hz, kdpc);
+	/* negative due time is relative, positive is absolute */
+	if (duetime_ticks <= 0)
+		expires_ticks = -duetime_ticks;
+	else {
+		now = ticks_1601();
+		expires_ticks = duetime_ticks > now ? duetime_ticks - now : 0;
+	}
+	return wrap_set_timer(nt_timer, expires_ticks,
+			      (u64)period_ms * TICKSPERMSEC, kdpc);
 }
 
 wstdcall BOOLEAN WIN_FUNC(KeSetTimer,3)
@@ -563,7 +733,11 @@ wstdcall BOOLEAN WIN_FUNC(KeCancelTimer,1)
 	/* disable timer before deleting so if it is periodic timer, it
 	 * won't be re-armed after deleting */
 	wrap_timer->repeat = 0;
+#ifdef WRAP_HRTIMER
+	ret = hrtimer_cancel(&wrap_timer->timer);
+#else
 	ret = del_timer_sync(&wrap_timer->timer);
+#endif
 	/* the documentation for KeCancelTimer suggests the DPC is
 	 * deqeued, but actually DPC is left to run */
 	if (ret)
@@ -591,25 +765,24 @@ wstdcall void WIN_FUNC(KeInitializeDpc,3)
 	InitializeListHead(&kdpc->list);
 }
 
-static void kdpc_worker(struct work_struct *dummy)
+/* runs DPCs in kdpc_queue until it is empty; called at
+ * DISPATCH_LEVEL */
+static void kdpc_queue_run(struct kdpc_queue *kdpc_queue)
 {
 	struct nt_list *entry;
 	struct kdpc *kdpc;
 	unsigned long flags;
-	KIRQL irql;
 
-	WORKENTER("");
-	irql = raise_irql(DISPATCH_LEVEL);
 	while (1) {
-		spin_lock_irqsave(&kdpc_list_lock, flags);
-		entry = RemoveHeadList(&kdpc_list);
+		spin_lock_irqsave(&kdpc_queue->lock, flags);
+		entry = RemoveHeadList(&kdpc_queue->list);
 		if (entry) {
 			kdpc = container_of(entry, struct kdpc, list);
-			assert(kdpc->queued);
-			kdpc->queued = 0;
+			assert(kdpc->queue == kdpc_queue);
+			kdpc->queue = NULL;
 		} else
 			kdpc = NULL;
-		spin_unlock_irqrestore(&kdpc_list_lock, flags);
+		spin_unlock_irqrestore(&kdpc_queue->lock, flags);
 		if (!kdpc)
 			break;
 		WORKTRACE("%p, %p, %p, %p, %p", kdpc, kdpc->func, kdpc->ctx,
@@ -618,54 +791,98 @@ static void kdpc_worker(struct work_struct *dummy)
 		LIN2WIN4(kdpc->func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
 		assert_irql(_irql_ == DISPATCH_LEVEL);
 	}
+}
+
+static void kdpc_worker(struct work_struct *work)
+{
+	struct kdpc_queue *kdpc_queue;
+	KIRQL irql;
+
+	kdpc_queue = container_of(work, struct kdpc_queue, work);
+	WORKENTER("%p", kdpc_queue);
+	irql = raise_irql(DISPATCH_LEVEL);
+	kdpc_queue_run(kdpc_queue);
 	lower_irql(irql);
 	WORKEXIT(return);
 }
 
+/* as in Windows, this should be called at PASSIVE_LEVEL; in a DPC,
+ * i.e., in kdpc_wq's worker, flush_workqueue would wait for the
+ * worker itself, so DPCs still in queues are run here instead
+ * (without waiting for those already running on other cpus) */
 wstdcall void WIN_FUNC(KeFlushQueuedDpcs,0)
 	(void)
 {
-	kdpc_worker(NULL);
+	KIRQL irql;
+	int cpu;
+
+	irql = current_irql();
+	if (irql == PASSIVE_LEVEL) {
+		/* waits for DPCs queued on all cpus */
+		flush_workqueue(kdpc_wq);
+		return;
+	}
+	WARNING("called at irql %d", irql);
+	if (irql > DISPATCH_LEVEL)
+		return;
+	irql = raise_irql(DISPATCH_LEVEL);
+	for_each_online_cpu(cpu)
+		kdpc_queue_run(&per_cpu(kdpc_queues, cpu));
+	lower_irql(irql);
 }
 
 BOOLEAN queue_kdpc(struct kdpc *kdpc)
 {
+	struct kdpc_queue *kdpc_queue;
 	BOOLEAN ret;
 	unsigned long flags;
+	int cpu;
 
 	WORKENTER("%p", kdpc);
-	spin_lock_irqsave(&kdpc_list_lock, flags);
-	if (kdpc->queued)
+	if (kdpc->nr_cpu && cpu_online(kdpc->nr_cpu - 1))
+		cpu = kdpc->nr_cpu - 1;
+	else
+		cpu = raw_smp_processor_id();
+	kdpc_queue = &per_cpu(kdpc_queues, cpu);
+	spin_lock_irqsave(&kdpc_queue->lock, flags);
+	/* kdpc may be queued on another cpu's queue; it is claimed
+	 * while holding the lock of the queue it is added to, so
+	 * dequeue_kdpc and kdpc_worker see it either queued and in
+	 * the list or not queued */
+	if (cmpxchg(&kdpc->queue, NULL, kdpc_queue) != NULL)
 		ret = FALSE;
 	else {
 		if (unlikely(kdpc->importance == HighImportance))
-			InsertHeadList(&kdpc_list, &kdpc->list);
+			InsertHeadList(&kdpc_queue->list, &kdpc->list);
 		else
-			InsertTailList(&kdpc_list, &kdpc->list);
-		kdpc->queued = 1;
+			InsertTailList(&kdpc_queue->list, &kdpc->list);
 		ret = TRUE;
 	}
-	spin_unlock_irqrestore(&kdpc_list_lock, flags);
+	spin_unlock_irqrestore(&kdpc_queue->lock, flags);
 	if (ret == TRUE)
-		queue_work(ntos_wq, &kdpc_work);
-	WORKTRACE("%d", ret);
+		queue_work_on(cpu, kdpc_wq, &kdpc_queue->work);
+	WORKTRACE("%d, %d", ret, cpu);
 	return ret;
 }
 
 BOOLEAN dequeue_kdpc(struct kdpc *kdpc)
 {
+	struct kdpc_queue *kdpc_queue;
 	BOOLEAN ret;
 	unsigned long flags;
 
 	WORKENTER("%p", kdpc);
-	spin_lock_irqsave(&kdpc_list_lock, flags);
-	if (kdpc->queued) {
+	kdpc_queue = ACCESS_ONCE(kdpc->queue);
+	if (!kdpc_queue)
+		return FALSE;
+	spin_lock_irqsave(&kdpc_queue->lock, flags);
+	if (kdpc->queue == kdpc_queue) {
 		RemoveEntryList(&kdpc->list);
-		kdpc->queued = 0;
+		kdpc->queue = NULL;
 		ret = TRUE;
 	} else
 		ret = FALSE;
-	spin_unlock_irqrestore(&kdpc_list_lock, flags);
+	spin_unlock_irqrestore(&kdpc_queue->lock, flags);
 	WORKTRACE("%d", ret);
 	return ret;
 }
@@ -685,54 +902,216 @@ wstdcall BOOLEAN WIN_FUNC(KeRemoveQueueDpc,1)
 	return dequeue_kdpc(kdpc);
 }
 
+wstdcall void WIN_FUNC(KeSetTargetProcessorDpc,2)
+	(struct kdpc *kdpc, CCHAR cpu)
+{
+	ENTER3("%p, %d", kdpc, cpu);
+	if (cpu >= 0 && cpu < NR_CPUS)
+		kdpc->nr_cpu = cpu + 1;
+	else
+		WARNING("invalid processor %d", cpu);
+}
+
 wstdcall void WIN_FUNC(KeSetImportanceDpc,2)
 	(struct kdpc *kdpc, enum kdpc_importance importance)
 {
 	kdpc->importance = importance;
 }
 
-static void ntos_work_worker(struct work_struct *dummy)
+static void ntos_work_run(struct ntos_work_queue *queue, NTOS_WORK_FUNC func,
+			  void *arg1, void *arg2, unsigned long stamp)
 {
-	struct ntos_work_item *ntos_work_item;
+	unsigned long latency;
+
+	latency = (unsigned long)ktime_to_ns(ktime_get()) - stamp;
+	queue->runs++;
+	queue->latency_total += latency;
+	if (latency > queue->latency_max)
+		queue->latency_max = latency;
+	WORKTRACE("%p: executing %p, %p, %p", current, func, arg1, arg2);
+	LIN2WIN2(func, arg1, arg2);
+}
+
+/* runs items published in ring; work may run on more than one thread
+ * at the same time (e.g., when queue_work_on is queue_work or the
+ * work is stolen), so only the thread that owns 'draining' consumes
+ * ring */
+static void ntos_work_drain_ring(struct ntos_work_queue *queue)
+{
+	struct ntos_work_item *item;
+	NTOS_WORK_FUNC func;
+	void *arg1, *arg2;
+	unsigned long stamp;
+
+	if (test_and_set_bit(0, &queue->draining))
+		return;
+	while (1) {
+		item = &queue->ring[queue->cons % NTOS_WORK_RING_SIZE];
+		func = ACCESS_ONCE(item->func);
+		/* if slot is claimed but not yet published, producer
+		 * queues this work again after publishing it */
+		if (!func) {
+			clear_bit(0, &queue->draining);
+			smp_mb__after_clear_bit();
+			/* item published after ring was found empty,
+			 * while the work that producer queued found
+			 * 'draining' set */
+			if (!ACCESS_ONCE(item->func) ||
+			    test_and_set_bit(0, &queue->draining))
+				break;
+			continue;
+		}
+		smp_rmb();
+		arg1 = item->arg1;
+		arg2 = item->arg2;
+		stamp = item->stamp;
+		item->func = NULL;
+		/* producers may reuse the slot once cons is advanced */
+		smp_mb();
+		queue->cons++;
+		ntos_work_run(queue, func, arg1, arg2, stamp);
+	}
+}
+
+static void ntos_work_worker(struct work_struct *work)
+{
+	struct ntos_work_queue *queue;
+	struct ntos_work_item *item;
 	struct nt_list *cur;
+	NTOS_WORK_FUNC func;
+	void *arg1, *arg2;
+	unsigned long stamp;
 
+	queue = container_of(work, struct ntos_work_queue, work);
+	ntos_work_drain_ring(queue);
 	while (1) {
 		spin_lock_bh(&ntos_work_lock);
 		cur = RemoveHeadList(&ntos_work_list);
 		spin_unlock_bh(&ntos_work_lock);
 		if (!cur)
 			break;
-		ntos_work_item = container_of(cur, struct ntos_work_item, list);
-		WORKTRACE("%p: executing %p, %p, %p", current,
-			  ntos_work_item->func, ntos_work_item->arg1,
-			  ntos_work_item->arg2);
-		LIN2WIN2(ntos_work_item->func, ntos_work_item->arg1,
-			 ntos_work_item->arg2);
-		kfree(ntos_work_item);
+		item = container_of(cur, struct ntos_work_item, list);
+		func = item->func;
+		arg1 = item->arg1;
+		arg2 = item->arg2;
+		stamp = item->stamp;
+		kfree(item);
+		ntos_work_run(queue, func, arg1, arg2, stamp);
 	}
 	WORKEXIT(return);
 }
 
 int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2)
 {
-	struct ntos_work_item *ntos_work_item;
+	struct ntos_work_queue *queue;
+	struct ntos_work_item *item;
+	unsigned int prod, depth;
+	unsigned long stamp;
+	int cpu;
 
 	WORKENTER("adding work: %p, %p, %p", func, arg1, arg2);
-	ntos_work_item = kmalloc(sizeof(*ntos_work_item), irql_gfp());
-	if (!ntos_work_item) {
-		ERROR("couldn't allocate memory");
-		return -ENOMEM;
+	stamp = (unsigned long)ktime_to_ns(ktime_get());
+	/* if we are moved to another cpu, the item is still run, just
+	 * not on the cpu it is queued from */
+	cpu = raw_smp_processor_id();
+	queue = &per_cpu(ntos_work_queues, cpu);
+	do {
+		prod = ACCESS_ONCE(queue->prod);
+		depth = prod - ACCESS_ONCE(queue->cons);
+		if (depth >= NTOS_WORK_RING_SIZE)
+			break;
+	} while (cmpxchg(&queue->prod, prod, prod + 1) != prod);
+
+	if (depth < NTOS_WORK_RING_SIZE) {
+		item = &queue->ring[prod % NTOS_WORK_RING_SIZE];
+		item->arg1 = arg1;
+		item->arg2 = arg2;
+		item->stamp = stamp;
+		smp_wmb();
+		item->func = func;
+		if (depth + 1 > queue->max_depth)
+			queue->max_depth = depth + 1;
+	} else {
+		item = kmalloc(sizeof(*item), irql_gfp());
+		if (!item) {
+			ERROR("couldn't allocate memory");
+			return -ENOMEM;
+		}
+		item->func = func;
+		item->arg1 = arg1;
+		item->arg2 = arg2;
+		item->stamp = stamp;
+		spin_lock_bh(&ntos_work_lock);
+		InsertTailList(&ntos_work_list, &item->list);
+		spin_unlock_bh(&ntos_work_lock);
+		queue->overflows++;
 	}
-	ntos_work_item->func = func;
-	ntos_work_item->arg1 = arg1;
-	ntos_work_item->arg2 = arg2;
-	spin_lock_bh(&ntos_work_lock);
-	InsertTailList(&ntos_work_list, &ntos_work_item->list);
-	spin_unlock_bh(&ntos_work_lock);
-	queue_work(ntos_wq, &ntos_work);
+	queue->queued++;
+	queue_work_on(cpu, ntos_work_wq, &queue->work);
 	WORKEXIT(return 0);
 }
 
+#ifdef SPINLOCK_STATS
+
+struct nt_spin_lock_stats spin_lock_stats[SPIN_LOCK_STATS_SIZE];
+
+/* stats slot for lock; slots are never freed, so if a lock's memory
+ * is reused for another lock, counters are accumulated; if table is
+ * full, lock is not tracked */
+static struct nt_spin_lock_stats *spin_lock_stats_slot(NT_SPIN_LOCK *lock)
+{
+	struct nt_spin_lock_stats *stats;
+	unsigned long hash;
+	int i;
+
+	hash = hash_ptr(lock, SPIN_LOCK_STATS_HASH_BITS);
+	for (i = 0; i < 8; i++) {
+		stats = &spin_lock_stats[(hash + i) &
+					 (SPIN_LOCK_STATS_SIZE - 1)];
+		if (stats->lock == lock)
+			return stats;
+		if (!stats->lock && cmpxchg(&stats->lock, NULL, lock) == NULL)
+			return stats;
+	}
+	return NULL;
+}
+
+/* called by owner, so counters of a lock are not updated
+ * concurrently */
+void nt_spin_lock_acquired(NT_SPIN_LOCK *lock, unsigned long spins,
+			   void *caller)
+{
+	struct nt_spin_lock_stats *stats = spin_lock_stats_slot(lock);
+
+	if (!stats)
+		return;
+	stats->acquired++;
+	if (spins) {
+		stats->contended++;
+		stats->spins += spins;
+		if (spins > stats->max_spins)
+			stats->max_spins = spins;
+		stats->caller = caller;
+	}
+	stats->hold_start = get_cycles();
+}
+
+void nt_spin_lock_releasing(NT_SPIN_LOCK *lock)
+{
+	struct nt_spin_lock_stats *stats = spin_lock_stats_slot(lock);
+	cycles_t held;
+
+	if (!stats || !stats->hold_start)
+		return;
+	held = get_cycles() - stats->hold_start;
+	stats->hold_cycles += held;
+	if (held > stats->max_hold_cycles)
+		stats->max_hold_cycles = held;
+	stats->hold_start = 0;
+}
+
+#endif
+
 wstdcall void WIN_FUNC(KeInitializeSpinLock,1)
 	(NT_SPIN_LOCK *lock)
 {
@@ -795,25 +1174,278 @@ wstdcall KIRQL WIN_FUNC(KeAcquireSpinLockRaiseToDpc,1)
 	return nt_spin_lock_irql(lock, DISPATCH_LEVEL);
 }
 
-wstdcall void *WIN_FUNC(ExAllocatePoolWithTag,3)
-	(enum pool_type pool_type, SIZE_T size, ULONG tag)
+/* Pool allocations are served, as in Windows, by size: blocks that
+ * fit in a page along with a header (that records tag and size) come
+ * from kmalloc, except that blocks of power-of-two size up to half a
+ * page come from pool_pow2_caches, whose objects are just big enough
+ * for block and header (with kmalloc, the header would push them to
+ * the next size class); bigger blocks are pages from page allocator,
+ * up to pool_max_order, so that drivers get physically contiguous
+ * memory without the cost of vmalloc (mapping pages and TLB flushes
+ * when freeing); if that is not possible, vmalloc is used. Big blocks
+ * have no header (drivers often allocate exact pages) and are tracked
+ * in pool_block_hash by address instead */
+
+struct pool_header {
+	ULONG tag;
+	ULONG size;
+} __attribute__((aligned(2 * sizeof(void *))));
+
+#define POOL_SMALL_MAX (PAGE_SIZE - sizeof(struct pool_header))
+
+/* size of blocks allocated from lookaside_caches is this flag and
+ * index of cache */
+#define POOL_LOOKASIDE_CACHE 0x80000000
+/* size of blocks allocated from pool_pow2_caches is this flag and
+ * index of cache */
+#define POOL_POW2_CACHE 0x40000000
+
+struct lookaside_cache {
+	struct kmem_cache *cache;
+	ULONG size;
+	char name[32];
+};
+
+#define LOOKASIDE_CACHES 32
+static struct lookaside_cache lookaside_caches[LOOKASIDE_CACHES];
+static int lookaside_cache_count;
+static struct mutex lookaside_cache_mutex;
+
+#define POOL_POW2_MIN_SHIFT 5
+#define POOL_POW2_MIN (1 << POOL_POW2_MIN_SHIFT)
+#define POOL_POW2_CACHES (PAGE_SHIFT - POOL_POW2_MIN_SHIFT)
+static struct kmem_cache *pool_pow2_caches[POOL_POW2_CACHES];
+static char pool_pow2_names[POOL_POW2_CACHES][24];
+
+struct pool_block {
+	struct pool_block *next;
+	void *addr;
+	SIZE_T size;
+	ULONG tag;
+	/* order of pages, or -1 if vmalloc'ed */
+	int order;
+};
+
+struct pool_block_bucket {
+	spinlock_t lock;
+	struct pool_block *head;
+};
+
+#define POOL_BLOCK_HASH_BITS 9
+static struct pool_block_bucket pool_block_hash[1 << POOL_BLOCK_HASH_BITS];
+
+struct pool_tag_stats pool_tag_stats[POOL_TAGS];
+static spinlock_t pool_tag_lock;
+atomic_long_t pool_page_blocks, pool_vmalloc_blocks, pool_pow2_blocks;
+
+/* entries are never removed, so they are looked up without lock; new
+ * tags are added under pool_tag_lock */
+static struct pool_tag_stats *pool_tag_stats_get(ULONG tag)
+{
+	struct pool_tag_stats *stats;
+	int i, n, new;
+
+	new = 0;
+	i = hash_32(tag, POOL_TAG_HASH_BITS);
+	while (1) {
+		for (n = 0; n < POOL_TAGS; n++) {
+			stats = &pool_tag_stats[(i + n) % POOL_TAGS];
+			if (!stats->used)
+				break;
+			smp_rmb();
+			if (stats->tag == tag)
+				goto found;
+		}
+		if (new)
+			break;
+		spin_lock_bh(&pool_tag_lock);
+		new = 1;
+	}
+	if (n < POOL_TAGS) {
+		stats->tag = tag;
+		smp_wmb();
+		stats->used = 1;
+	} else
+		stats = NULL;
+found:
+	if (new)
+		spin_unlock_bh(&pool_tag_lock);
+	return stats;
+}
+
+static void pool_tag_alloc(ULONG tag, SIZE_T size, void *addr)
+{
+	struct pool_tag_stats *stats;
+	long live;
+
+	stats = pool_tag_stats_get(tag);
+	if (!stats)
+		return;
+	if (!addr) {
+		atomic_long_inc(&stats->failed);
+		return;
+	}
+	atomic_long_inc(&stats->allocs);
+	live = atomic_long_add_return(size, &stats->live_bytes);
+	if (live > atomic_long_read(&stats->max_live_bytes))
+		atomic_long_set(&stats->max_live_bytes, live);
+}
+
+static void pool_tag_free(ULONG tag, SIZE_T size)
+{
+	struct pool_tag_stats *stats;
+
+	stats = pool_tag_stats_get(tag);
+	if (!stats)
+		return;
+	atomic_long_inc(&stats->frees);
+	atomic_long_sub(size, &stats->live_bytes);
+}
+
+static inline struct pool_block_bucket *pool_block_bucket(void *addr)
+{
+	return &pool_block_hash[hash_ptr(addr, POOL_BLOCK_HASH_BITS)];
+}
+
+static void pool_block_add(struct pool_block *block)
+{
+	struct pool_block_bucket *bucket;
+
+	bucket = pool_block_bucket(block->addr);
+	spin_lock_bh(&bucket->lock);
+	block->next = bucket->head;
+	bucket->head = block;
+	spin_unlock_bh(&bucket->lock);
+}
+
+static struct pool_block *pool_block_find(void *addr, int remove)
 {
+	struct pool_block_bucket *bucket;
+	struct pool_block *block, **prev;
+
+	bucket = pool_block_bucket(addr);
+	spin_lock_bh(&bucket->lock);
+	for (prev = &bucket->head; (block = *prev); prev = &block->next) {
+		if (block->addr == addr) {
+			if (remove)
+				*prev = block->next;
+			break;
+		}
+	}
+	spin_unlock_bh(&bucket->lock);
+	return block;
+}
+
+/* index in pool_pow2_caches for blocks of given size, or -1 */
+static inline int pool_pow2_index(SIZE_T size)
+{
+	int i;
+
+	if (size < POOL_POW2_MIN || size > PAGE_SIZE / 2 ||
+	    (size & (size - 1)))
+		return -1;
+	i = fls(size) - 1 - POOL_POW2_MIN_SHIFT;
+	if (!pool_pow2_caches[i])
+		return -1;
+	return i;
+}
+
+static void *pool_pow2_alloc(int i, ULONG tag, gfp_t gfp)
+{
+	struct pool_header *hdr;
+
+	hdr = kmem_cache_alloc(pool_pow2_caches[i], gfp);
+	if (!hdr)
+		return NULL;
+	atomic_long_inc(&pool_pow2_blocks);
+	hdr->tag = tag;
+	hdr->size = POOL_POW2_CACHE | i;
+	return hdr + 1;
+}
+
+static void *big_pool_alloc(SIZE_T size, ULONG tag, gfp_t gfp)
+{
+	struct pool_block *block;
 	void *addr;
 
-	ENTER4("pool_type: %d, size: %zu, tag: 0x%x", pool_type, size, tag);
-	assert_irql(_irql_ <= DISPATCH_LEVEL);
-	if (size < PAGE_SIZE)
-		addr = kmalloc(size, irql_gfp());
-	else {
-		if (irql_gfp() & GFP_ATOMIC) {
+	block = kmalloc(sizeof(*block), gfp);
+	if (!block)
+		return NULL;
+	addr = NULL;
+	block->order = get_order(size);
+	if (block->order <= min(pool_max_order, MAX_ORDER - 1)) {
+		addr = wrap_get_free_pages(gfp | __GFP_NOWARN | __GFP_NORETRY,
+					   size);
+		if (addr)
+			atomic_long_inc(&pool_page_blocks);
+	}
+	if (!addr) {
+		block->order = -1;
+		if (gfp & GFP_ATOMIC)
 			addr = __vmalloc(size, GFP_ATOMIC | __GFP_HIGHMEM,
 					 PAGE_KERNEL);
-			TRACE1("%p, %zu", addr, size);
-		} else {
+		else
 			addr = vmalloc(size);
-			TRACE1("%p, %zu", addr, size);
+		if (!addr) {
+			kfree(block);
+			return NULL;
 		}
+		atomic_long_inc(&pool_vmalloc_blocks);
 	}
+	TRACE1("%p, %zu, %d", addr, size, block->order);
+	block->addr = addr;
+	block->size = size;
+	block->tag = tag;
+	pool_block_add(block);
+	return addr;
+}
+
+static inline int pool_small_block(void *addr)
+{
+	if ((unsigned long)addr >= VMALLOC_START &&
+	    (unsigned long)addr < VMALLOC_END)
+		return 0;
+	return PageSlab(virt_to_head_page(addr));
+}
+
+/* start of memory allocated for pool block at 'addr' with kmalloc or
+ * page allocator, or NULL if block is from pool_pow2_caches */
+void *pool_block_base(void *addr)
+{
+	struct pool_header *hdr;
+
+	if (!pool_small_block(addr))
+		return addr;
+	hdr = (struct pool_header *)addr - 1;
+	if (hdr->size & POOL_POW2_CACHE)
+		return NULL;
+	return hdr;
+}
+
+wstdcall void *WIN_FUNC(ExAllocatePoolWithTag,3)
+	(enum pool_type pool_type, SIZE_T size, ULONG tag)
+{
+	struct pool_header *hdr;
+	void *addr;
+	gfp_t gfp;
+	int i;
+
+	ENTER4("pool_type: %d, size: %zu, tag: 0x%x", pool_type, size, tag);
+	assert_irql(_irql_ <= DISPATCH_LEVEL);
+	gfp = irql_gfp();
+	if ((i = pool_pow2_index(size)) >= 0)
+		addr = pool_pow2_alloc(i, tag, gfp);
+	else if (size <= POOL_SMALL_MAX) {
+		hdr = kmalloc(sizeof(*hdr) + size, gfp);
+		if (hdr) {
+			hdr->tag = tag;
+			hdr->size = size;
+			addr = hdr + 1;
+		} else
+			addr = NULL;
+	} else
+		addr = big_pool_alloc(size, tag, gfp);
+	pool_tag_alloc(tag, size, addr);
 	DBG_BLOCK(1) {
 		if (addr)
 			TRACE4("addr: %p, %zu", addr, size);
@@ -827,13 +1459,45 @@ WIN_FUNC_DECL(ExAllocatePoolWithTag,3)
 wstdcall void WIN_FUNC(ExFreePoolWithTag,2)
 	(void *addr, ULONG tag)
 {
+	struct pool_header *hdr;
+	struct pool_block *block;
+
 	TRACE4("%p", addr);
-	if ((unsigned long)addr < VMALLOC_START ||
-	    (unsigned long)addr >= VMALLOC_END)
-		kfree(addr);
-	else
+	if (!addr)
+		EXIT4(return);
+	if (pool_small_block(addr)) {
+		hdr = (struct pool_header *)addr - 1;
+		if (hdr->size & POOL_LOOKASIDE_CACHE) {
+			struct lookaside_cache *lc;
+			lc = &lookaside_caches[hdr->size &
+					       ~POOL_LOOKASIDE_CACHE];
+			pool_tag_free(hdr->tag, lc->size);
+			kmem_cache_free(lc->cache, hdr);
+		} else if (hdr->size & POOL_POW2_CACHE) {
+			int i = hdr->size & ~POOL_POW2_CACHE;
+			pool_tag_free(hdr->tag, POOL_POW2_MIN << i);
+			kmem_cache_free(pool_pow2_caches[i], hdr);
+			atomic_long_dec(&pool_pow2_blocks);
+		} else {
+			pool_tag_free(hdr->tag, hdr->size);
+			kfree(hdr);
+		}
+		EXIT4(return);
+	}
+	block = pool_block_find(addr, 1);
+	if (!block) {
+		ERROR("invalid pool block %p", addr);
+		EXIT4(return);
+	}
+	pool_tag_free(block->tag, block->size);
+	if (block->order < 0) {
 		vfree(addr);
-
+		atomic_long_dec(&pool_vmalloc_blocks);
+	} else {
+		free_pages((unsigned long)addr, block->order);
+		atomic_long_dec(&pool_page_blocks);
+	}
+	kfree(block);
 	EXIT4(return);
 }
 
@@ -844,6 +1508,253 @@ wstdcall void WIN_FUNC(ExFreePool,1)
 }
 WIN_FUNC_DECL(ExFreePool,1)
 
+/* if a cache can't be created, blocks of its size are allocated with
+ * header from kmalloc */
+static void pool_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pool_block_hash); i++)
+		spin_lock_init(&pool_block_hash[i].lock);
+	for (i = 0; i < POOL_POW2_CACHES; i++) {
+		int size = POOL_POW2_MIN << i;
+		snprintf(pool_pow2_names[i], sizeof(pool_pow2_names[i]),
+			 DRIVER_NAME "_pool_%d", size);
+		pool_pow2_caches[i] =
+			wrap_kmem_cache_create(pool_pow2_names[i],
+					       sizeof(struct pool_header) +
+					       size,
+					       __alignof__(struct pool_header),
+					       0);
+		if (!pool_pow2_caches[i])
+			WARNING("couldn't create cache %s",
+				pool_pow2_names[i]);
+	}
+}
+
+static void pool_exit(void)
+{
+	int i;
+
+	for (i = 0; i < POOL_POW2_CACHES; i++) {
+		if (pool_pow2_caches[i]) {
+			kmem_cache_destroy(pool_pow2_caches[i]);
+			pool_pow2_caches[i] = NULL;
+		}
+	}
+}
+
+/* Drivers allocate from and free to lookaside lists themselves (with
+ * inline functions), using alloc_func when the list is empty and
+ * free_func when it already has 'depth' entries. As in Windows, depth
+ * of each list is adjusted every second based on how many
+ * allocations missed the list since last time. Lists that use default
+ * functions get their entries from a kmem_cache shared by lists of
+ * same size; since freeing those entries doesn't involve driver,
+ * entries beyond depth are freed when depth is adjusted and all
+ * entries are freed when memory is low */
+
+#define LOOKASIDE_MIN_DEPTH 4
+#define LOOKASIDE_MAX_DEPTH 256
+#define LOOKASIDE_ADJUST_INTERVAL HZ
+
+static struct nt_list lookaside_lists;
+static spinlock_t lookaside_lock;
+static struct timer_list lookaside_timer;
+static struct work_struct lookaside_work;
+
+static int lookaside_cache_find(SIZE_T size)
+{
+	int i, n;
+
+	n = lookaside_cache_count;
+	smp_rmb();
+	for (i = 0; i < n; i++)
+		if (lookaside_caches[i].size == size)
+			return i;
+	return -1;
+}
+
+/* index of cache for entries of given size, creating it if necessary
+ * (and possible) */
+static int lookaside_cache_get(SIZE_T size)
+{
+	struct lookaside_cache *lc;
+	int i;
+
+	if (size > POOL_SMALL_MAX)
+		return -1;
+	i = lookaside_cache_find(size);
+	if (i >= 0 || irql_gfp() == GFP_ATOMIC)
+		return i;
+	mutex_lock(&lookaside_cache_mutex);
+	i = lookaside_cache_find(size);
+	if (i < 0 && lookaside_cache_count < LOOKASIDE_CACHES) {
+		lc = &lookaside_caches[lookaside_cache_count];
+		snprintf(lc->name, sizeof(lc->name), DRIVER_NAME "_la_%lu",
+			 (unsigned long)size);
+		lc->cache = wrap_kmem_cache_create(lc->name,
+						   sizeof(struct pool_header) +
+						   size,
+						   sizeof(struct pool_header),
+						   0);
+		if (lc->cache) {
+			lc->size = size;
+			smp_wmb();
+			i = lookaside_cache_count++;
+		} else
+			WARNING("couldn't create cache %s", lc->name);
+	}
+	mutex_unlock(&lookaside_cache_mutex);
+	return i;
+}
+
+wstdcall void *WIN_FUNC(lookaside_cache_alloc,3)
+	(enum pool_type pool_type, SIZE_T size, ULONG tag)
+{
+	struct pool_header *hdr;
+	void *addr;
+	int i;
+
+	i = lookaside_cache_find(size);
+	if (i < 0)
+		return ExAllocatePoolWithTag(pool_type, size, tag);
+	hdr = kmem_cache_alloc(lookaside_caches[i].cache, irql_gfp());
+	if (hdr) {
+		hdr->tag = tag;
+		hdr->size = POOL_LOOKASIDE_CACHE | i;
+		addr = hdr + 1;
+	} else
+		addr = NULL;
+	pool_tag_alloc(tag, size, addr);
+	TRACE4("%p, %zu", addr, size);
+	return addr;
+}
+WIN_FUNC_DECL(lookaside_cache_alloc,3)
+
+/* as ExpComputeLookasideDepth in Windows: shrink if the list is
+ * hardly used or almost never misses, otherwise grow by miss ratio */
+static void lookaside_adjust_depth(struct npaged_lookaside_list *lookaside)
+{
+	ULONG allocs, misses;
+	int depth, change;
+
+	allocs = lookaside->totalallocs - lookaside->lasttotallocs;
+	misses = lookaside->u1.allocmisses - lookaside->u3.lastallocmisses;
+	lookaside->lasttotallocs = lookaside->totalallocs;
+	lookaside->u3.lastallocmisses = lookaside->u1.allocmisses;
+
+	depth = lookaside->depth;
+	if (allocs < 75)
+		depth -= 10;
+	else {
+		/* misses per 1000 allocations */
+		misses = div_u64((u64)misses * 1000, allocs);
+		if (misses < 5)
+			depth--;
+		else {
+			change = misses * (lookaside->maxdepth - depth) / 2000
+				+ 5;
+			depth += min(change, 30);
+		}
+	}
+	if (depth > lookaside->maxdepth)
+		depth = lookaside->maxdepth;
+	if (depth < LOOKASIDE_MIN_DEPTH)
+		depth = LOOKASIDE_MIN_DEPTH;
+	lookaside->depth = depth;
+}
+
+/* take entries off lists with default free_func until each has at
+ * most 'depth' entries (or its current depth, if 'depth' is
+ * negative), or until 'count' entries are taken; called with
+ * lookaside_lock held. Entries are chained to 'trimmed' and must be
+ * freed with lookaside_free after lookaside_lock is released, as
+ * large entries may be vmalloc'ed and vfree can't be called with
+ * bottom halves disabled. Returns number of entries still cached */
+static int lookaside_trim(int depth, int count, struct nt_slist **trimmed)
+{
+	struct npaged_lookaside_list *lookaside;
+	struct nt_slist *entry;
+	int cached, keep;
+
+	cached = 0;
+	nt_list_for_each_entry(lookaside, &lookaside_lists, list) {
+		if (lookaside->free_func != WIN_FUNC_PTR(ExFreePool,1))
+			continue;
+		keep = depth < 0 ? lookaside->depth : depth;
+		while (count > 0 && lookaside->head.depth > keep &&
+		       (entry = PopEntrySList(&lookaside->head,
+					      &nt_list_lock))) {
+			entry->next = *trimmed;
+			*trimmed = entry;
+			count--;
+		}
+		cached += lookaside->head.depth;
+	}
+	return cached;
+}
+
+static void lookaside_free(struct nt_slist *trimmed)
+{
+	struct nt_slist *entry;
+
+	while ((entry = trimmed)) {
+		trimmed = entry->next;
+		ExFreePool(entry);
+	}
+}
+
+static void lookaside_worker(struct work_struct *dummy)
+{
+	struct npaged_lookaside_list *lookaside;
+	struct nt_slist *trimmed = NULL;
+
+	spin_lock_bh(&lookaside_lock);
+	nt_list_for_each_entry(lookaside, &lookaside_lists, list)
+		lookaside_adjust_depth(lookaside);
+	lookaside_trim(-1, INT_MAX, &trimmed);
+	spin_unlock_bh(&lookaside_lock);
+	lookaside_free(trimmed);
+}
+
+/* lookaside_work is queued every second while there are lists */
+static void lookaside_timer_proc(unsigned long data)
+{
+	queue_work(ntos_wq, &lookaside_work);
+	if (!IsListEmpty(&lookaside_lists))
+		mod_timer(&lookaside_timer,
+			  jiffies + LOOKASIDE_ADJUST_INTERVAL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
+static int lookaside_shrink(struct shrinker *shrinker,
+			    struct shrink_control *sc)
+{
+	int nr_to_scan = sc->nr_to_scan;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+static int lookaside_shrink(struct shrinker *shrinker, int nr_to_scan,
+			    gfp_t gfp_mask)
+{
+#else
+static int lookaside_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+#endif
+	struct nt_slist *trimmed = NULL;
+	int cached;
+
+	spin_lock_bh(&lookaside_lock);
+	cached = lookaside_trim(0, nr_to_scan, &trimmed);
+	spin_unlock_bh(&lookaside_lock);
+	lookaside_free(trimmed);
+	return cached;
+}
+
+static struct shrinker lookaside_shrinker = {
+	.shrink = lookaside_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 wstdcall void WIN_FUNC(ExInitializeNPagedLookasideList,7)
 	(struct npaged_lookaside_list *lookaside,
 	 LOOKASIDE_ALLOC_FUNC *alloc_func, LOOKASIDE_FREE_FUNC *free_func,
@@ -857,12 +1768,14 @@ wstdcall void WIN_FUNC(ExInitializeNPagedLookasideList,7)
 
 	lookaside->size = size;
 	lookaside->tag = tag;
-	lookaside->depth = 4;
-	lookaside->maxdepth = 256;
+	lookaside->depth = LOOKASIDE_MIN_DEPTH;
+	lookaside->maxdepth = LOOKASIDE_MAX_DEPTH;
 	lookaside->pool_type = NonPagedPool;
 
 	if (alloc_func)
 		lookaside->alloc_func = alloc_func;
+	else if (lookaside_cache_get(size) >= 0)
+		lookaside->alloc_func = WIN_FUNC_PTR(lookaside_cache_alloc,3);
 	else
 		lookaside->alloc_func = WIN_FUNC_PTR(ExAllocatePoolWithTag,3);
 	if (free_func)
@@ -873,6 +1786,12 @@ wstdcall void WIN_FUNC(ExInitializeNPagedLookasideList,7)
 #ifndef CONFIG_X86_64
 	nt_spin_lock_init(&lookaside->obsolete);
 #endif
+	spin_lock_bh(&lookaside_lock);
+	InsertTailList(&lookaside_lists, &lookaside->list);
+	spin_unlock_bh(&lookaside_lock);
+	if (!timer_pending(&lookaside_timer))
+		mod_timer(&lookaside_timer,
+			  jiffies + LOOKASIDE_ADJUST_INTERVAL);
 	EXIT3(return);
 }
 
@@ -882,6 +1801,9 @@ wstdcall void WIN_FUNC(ExDeleteNPagedLookasideList,1)
 	struct nt_slist *entry;
 
 	ENTER3("lookaside = %p", lookaside);
+	spin_lock_bh(&lookaside_lock);
+	RemoveEntryList(&lookaside->list);
+	spin_unlock_bh(&lookaside_lock);
 	while ((entry = ExpInterlockedPopEntrySList(&lookaside->head)))
 		LIN2WIN1(lookaside->free_func, entry);
 	EXIT3(return);
@@ -975,7 +1897,42 @@ wstdcall void WIN_FUNC(ExNotifyCallback,3)
 	return;
 }
 
-/* check and set signaled state; should be called with dispatcher_lock held */
+static inline spinlock_t *dispatcher_lock(struct dispatcher_header *dh)
+{
+	return &dispatcher_locks[hash_ptr(dh, DISPATCHER_LOCK_HASH_BITS)];
+}
+
+/* take locks of all the objects; 'locks' is set to bitmap of locks
+ * taken, for dispatcher_unlock_objects */
+static void dispatcher_lock_objects(void *object[], ULONG count,
+				    unsigned long *locks)
+{
+	int i;
+
+	bitmap_zero(locks, DISPATCHER_LOCKS);
+	for (i = 0; i < count; i++)
+		__set_bit(hash_ptr(object[i], DISPATCHER_LOCK_HASH_BITS),
+			  locks);
+	local_bh_disable();
+	for (i = 0; i < DISPATCHER_LOCKS; i++) {
+		if (test_bit(i, locks))
+			spin_lock(&dispatcher_locks[i]);
+	}
+}
+
+static void dispatcher_unlock_objects(unsigned long *locks)
+{
+	int i;
+
+	for (i = DISPATCHER_LOCKS - 1; i >= 0; i--) {
+		if (test_bit(i, locks))
+			spin_unlock(&dispatcher_locks[i]);
+	}
+	local_bh_enable();
+}
+
+/* check and set signaled state; should be called with object's
+ * dispatcher_lock held */
 /* @grab indicates if the event should be grabbed or checked
  * - note that a semaphore may stay in signaled state for multiple
  * 'grabs' if the count is > 1 */
@@ -1011,7 +1968,7 @@ static int grab_object(struct dispatcher_header *dh,
 	EVENTEXIT(return 0);
 }
 
-/* this function should be called holding dispatcher_lock */
+/* this function should be called holding object's dispatcher_lock */
 static void object_signaled(struct dispatcher_header *dh)
 {
 	struct nt_list *cur, *next;
@@ -1043,6 +2000,7 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	typeof(jiffies) wait_hz = 0;
 	struct wait_block *wb, wb_array[THREAD_WAIT_OBJECTS];
 	struct dispatcher_header *dh;
+	DECLARE_BITMAP(locks, DISPATCHER_LOCKS);
 	KIRQL irql = current_irql();
 
 	EVENTENTER("%p, %d, %u, %p", current, count, wait_type, timeout);
@@ -1064,14 +2022,14 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	 * depending on how to satisfy wait. If all of them can be
 	 * grabbed, we will grab them in the next loop below */
 
-	spin_lock_bh(&dispatcher_lock);
+	dispatcher_lock_objects(object, count, locks);
 	for (i = wait_count = 0; i < count; i++) {
 		dh = object[i];
 		EVENTTRACE("%p: event %p (%d)", current, dh, dh->signal_state);
 		/* wait_type == 1 for WaitAny, 0 for WaitAll */
 		if (grab_object(dh, current, wait_type)) {
 			if (wait_type == WaitAny) {
-				spin_unlock_bh(&dispatcher_lock);
+				dispatcher_unlock_objects(locks);
 				EVENTEXIT(return STATUS_WAIT_0 + i);
 			}
 		} else {
@@ -1081,7 +2039,7 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	}
 
 	if (timeout && *timeout == 0 && wait_count) {
-		spin_unlock_bh(&dispatcher_lock);
+		dispatcher_unlock_objects(locks);
 		EVENTEXIT(return STATUS_TIMEOUT);
 	}
 
@@ -1105,7 +2063,21 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 			InsertTailList(&dh->wait_blocks, &wb[i].list);
 		}
 	}
-	spin_unlock_bh(&dispatcher_lock);
+	/* KeSetEvent doesn't take lock if no thread is waiting on the
+	 * event, so an event may have been signaled after it was
+	 * checked above, without seeing this thread in wait list;
+	 * check again now that wait blocks are visible */
+	if (wait_count) {
+		smp_mb();
+		for (i = 0; i < count; i++) {
+			dh = object[i];
+			if (wb[i].thread && dh->signal_state > 0)
+				object_signaled(dh);
+			if (wait_type == WaitAny && wait_done)
+				break;
+		}
+	}
+	dispatcher_unlock_objects(locks);
 	if (wait_count == 0)
 		EVENTEXIT(return STATUS_SUCCESS);
 
@@ -1125,7 +2097,7 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	 * alerted in some circumstances */
 	while (wait_count) {
 		res = wait_condition(wait_done, wait_hz, TASK_INTERRUPTIBLE);
-		spin_lock_bh(&dispatcher_lock);
+		dispatcher_lock_objects(object, count, locks);
 		EVENTTRACE("%p woke up: %d, %d", current, res, wait_done);
 		/* the event may have been set by the time
 		 * wrap_wait_event returned and spinlock obtained, so
@@ -1141,7 +2113,7 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 				assert(wb[i].object == NULL);
 				RemoveEntryList(&wb[i].list);
 			}
-			spin_unlock_bh(&dispatcher_lock);
+			dispatcher_unlock_objects(locks);
 			if (res < 0)
 				EVENTEXIT(return STATUS_ALERTED);
 			else
@@ -1167,12 +2139,12 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 					if (wb[j].thread && !wb[j].object)
 						RemoveEntryList(&wb[j].list);
 				}
-				spin_unlock_bh(&dispatcher_lock);
+				dispatcher_unlock_objects(locks);
 				EVENTEXIT(return STATUS_WAIT_0 + i);
 			}
 		}
 		wait_done = 0;
-		spin_unlock_bh(&dispatcher_lock);
+		dispatcher_unlock_objects(locks);
 		if (wait_count == 0)
 			EVENTEXIT(return STATUS_SUCCESS);
 
@@ -1208,16 +2180,25 @@ wstdcall LONG WIN_FUNC(KeSetEvent,3)
 	(struct nt_event *nt_event, KPRIORITY incr, BOOLEAN wait)
 {
 	LONG old_state;
+	spinlock_t *lock;
 
 	EVENTENTER("%p, %d", nt_event, nt_event->dh.type);
 	if (wait == TRUE)
 		WARNING("wait = %d, not yet implemented", wait);
-	spin_lock_bh(&dispatcher_lock);
-	old_state = nt_event->dh.signal_state;
-	nt_event->dh.signal_state = 1;
-	if (old_state == 0)
+	old_state = xchg(&nt_event->dh.signal_state, 1);
+	if (old_state)
+		EVENTEXIT(return old_state);
+	/* if no thread is waiting, we are done without taking lock;
+	 * xchg above is a full barrier, so a thread that is adding
+	 * itself to wait list now either is seen here or sees the
+	 * event signaled when it checks again after adding itself */
+	if (IsListEmpty(&nt_event->dh.wait_blocks))
+		EVENTEXIT(return old_state);
+	lock = dispatcher_lock(&nt_event->dh);
+	spin_lock_bh(lock);
+	if (nt_event->dh.signal_state > 0)
 		object_signaled(&nt_event->dh);
-	spin_unlock_bh(&dispatcher_lock);
+	spin_unlock_bh(lock);
 	EVENTEXIT(return old_state);
 }
 
@@ -1267,12 +2248,14 @@ wstdcall LONG WIN_FUNC(KeReleaseMutex,2)
 {
 	LONG ret;
 	struct task_struct *thread;
+	spinlock_t *lock;
 
 	EVENTENTER("%p, %d, %p", mutex, wait, current);
 	if (wait == TRUE)
 		WARNING("wait: %d", wait);
 	thread = current;
-	spin_lock_bh(&dispatcher_lock);
+	lock = dispatcher_lock(&mutex->dh);
+	spin_lock_bh(lock);
 	EVENTTRACE("%p, %p, %p, %d", mutex, thread, mutex->owner_thread,
 		   mutex->dh.signal_state);
 	if ((mutex->owner_thread == thread) && (mutex->dh.signal_state <= 0)) {
@@ -1288,7 +2271,7 @@ wstdcall LONG WIN_FUNC(KeReleaseMutex,2)
 	}
 	EVENTTRACE("%p, %p, %p, %d", mutex, thread, mutex->owner_thread,
 		   mutex->dh.signal_state);
-	spin_unlock_bh(&dispatcher_lock);
+	spin_unlock_bh(lock);
 	EVENTEXIT(return ret);
 }
 
@@ -1310,9 +2293,11 @@ wstdcall LONG WIN_FUNC(KeReleaseSemaphore,4)
 	 BOOLEAN wait)
 {
 	LONG ret;
+	spinlock_t *lock;
 
 	EVENTENTER("%p", semaphore);
-	spin_lock_bh(&dispatcher_lock);
+	lock = dispatcher_lock(&semaphore->dh);
+	spin_lock_bh(lock);
 	ret = semaphore->dh.signal_state;
 	assert(ret >= 0);
 	if (semaphore->dh.signal_state + adjustment <= semaphore->limit)
@@ -1324,7 +2309,7 @@ wstdcall LONG WIN_FUNC(KeReleaseSemaphore,4)
 	}
 	if (semaphore->dh.signal_state > 0)
 		object_signaled(&semaphore->dh);
-	spin_unlock_bh(&dispatcher_lock);
+	spin_unlock_bh(lock);
 	EVENTEXIT(return ret);
 }
 
@@ -1399,27 +2384,65 @@ wstdcall KAFFINITY WIN_FUNC(KeQueryActiveProcessors,0)
 	return bits;
 }
 
-struct nt_thread *get_current_nt_thread(void)
+/* should be called with ntoskernel_lock held */
+static void nt_thread_hash_add(struct nt_thread *thread)
 {
-	struct task_struct *task = current;
-	struct nt_thread *thread;
-	struct common_object_header *header;
+	unsigned long i;
 
-	TRACE6("task: %p", task);
-	thread = NULL;
-	spin_lock_bh(&ntoskernel_lock);
-	nt_list_for_each_entry(header, &object_list, list) {
-		TRACE6("%p, %d", header, header->type);
-		if (header->type != OBJECT_TYPE_NT_THREAD)
+	i = hash_ptr(thread->task, NT_THREAD_HASH_BITS);
+	thread->task_hash_next = nt_thread_task_hash[i];
+	rcu_assign_pointer(nt_thread_task_hash[i], thread);
+	i = hash_ptr(thread, NT_THREAD_HASH_BITS);
+	thread->thread_hash_next = nt_thread_hash[i];
+	rcu_assign_pointer(nt_thread_hash[i], thread);
+}
+
+/* should be called with ntoskernel_lock held; thread may be looked
+ * up until RCU grace period ends */
+static void nt_thread_hash_del(struct nt_thread *thread)
+{
+	struct nt_thread **p;
+
+	for (p = &nt_thread_task_hash[hash_ptr(thread->task,
+					       NT_THREAD_HASH_BITS)];
+	     *p; p = &(*p)->task_hash_next) {
+		if (*p == thread) {
+			rcu_assign_pointer(*p, thread->task_hash_next);
 			break;
-		thread = HEADER_TO_OBJECT(header);
-		TRACE6("%p, %p", thread, thread->task);
-		if (thread->task == task)
+		}
+	}
+	for (p = &nt_thread_hash[hash_ptr(thread, NT_THREAD_HASH_BITS)];
+	     *p; p = &(*p)->thread_hash_next) {
+		if (*p == thread) {
+			rcu_assign_pointer(*p, thread->thread_hash_next);
 			break;
-		else
-			thread = NULL;
+		}
 	}
+}
+
+/* make thread visible to lookups once its task is known */
+static void set_nt_thread_task(struct nt_thread *thread,
+			       struct task_struct *task)
+{
+	thread->task = task;
+	thread->pid = task->pid;
+	spin_lock_bh(&ntoskernel_lock);
+	nt_thread_hash_add(thread);
 	spin_unlock_bh(&ntoskernel_lock);
+}
+
+struct nt_thread *get_current_nt_thread(void)
+{
+	struct task_struct *task = current;
+	struct nt_thread *thread;
+
+	TRACE6("task: %p", task);
+	rcu_read_lock();
+	thread = rcu_dereference(nt_thread_task_hash[hash_ptr(task,
+						     NT_THREAD_HASH_BITS)]);
+	while (thread && thread->task != task)
+		thread = rcu_dereference(thread->task_hash_next);
+	rcu_read_unlock();
 	if (thread == NULL)
 		TRACE4("couldn't find thread for task %p, %d", task, task->pid);
 	TRACE6("%p", thread);
@@ -1429,21 +2452,20 @@ struct nt_thread *get_current_nt_thread(void)
 static struct task_struct *get_nt_thread_task(struct nt_thread *thread)
 {
 	struct task_struct *task;
-	struct common_object_header *header;
+	struct nt_thread *cur;
 
 	TRACE6("%p", thread);
 	task = NULL;
-	spin_lock_bh(&ntoskernel_lock);
-	nt_list_for_each_entry(header, &object_list, list) {
-		TRACE6("%p, %d", header, header->type);
-		if (header->type != OBJECT_TYPE_NT_THREAD)
-			break;
-		if (thread == HEADER_TO_OBJECT(header)) {
-			task = thread->task;
-			break;
-		}
-	}
-	spin_unlock_bh(&ntoskernel_lock);
+	/* thread may be an invalid pointer, so it is not dereferenced
+	 * until it is found in hash table */
+	rcu_read_lock();
+	cur = rcu_dereference(nt_thread_hash[hash_ptr(thread,
+						      NT_THREAD_HASH_BITS)]);
+	while (cur && cur != thread)
+		cur = rcu_dereference(cur->thread_hash_next);
+	if (cur)
+		task = cur->task;
+	rcu_read_unlock();
 	if (task == NULL)
 		TRACE2("%p: couldn't find task for %p", current, thread);
 	return task;
@@ -1457,16 +2479,13 @@ static struct nt_thread *create_nt_thread(struct task_struct *task)
 		ERROR("couldn't allocate thread object");
 		EXIT2(return NULL);
 	}
-	thread->task = task;
-	if (task)
-		thread->pid = task->pid;
-	else
-		thread->pid = 0;
 	nt_spin_lock_init(&thread->lock);
 	InitializeListHead(&thread->irps);
 	initialize_object(&thread->dh, ThreadObject, 0);
 	thread->dh.size = sizeof(*thread);
 	thread->prio = LOW_PRIORITY;
+	if (task)
+		set_nt_thread_task(thread, task);
 	return thread;
 }
 
@@ -1549,8 +2568,7 @@ static int ntdriver_thread(void *data)
 	typeof(thread_tramp->func) func = thread_tramp->func;
 	typeof(thread_tramp->ctx) ctx = thread_tramp->ctx;
 
-	thread_tramp->thread->task = current;
-	thread_tramp->thread->pid = current->pid;
+	set_nt_thread_task(thread_tramp->thread, current);
 	TRACE2("thread: %p, task: %p (%d)", thread_tramp->thread,
 	       current, current->pid);
 	complete(&thread_tramp->started);
@@ -1570,6 +2588,7 @@ wstdcall NTSTATUS WIN_FUNC(PsCreateSystemThread,7)
 	 void *client_id, void (*func)(void *) wstdcall, void *ctx)
 {
 	struct thread_trampoline thread_tramp;
+	struct task_struct *task;
 
 	ENTER2("handle = %p, access = %u, obj_attr = %p, process = %p, "
 	       "client_id = %p, func = %p, context = %p", handle, access,
@@ -1585,13 +2604,14 @@ wstdcall NTSTATUS WIN_FUNC(PsCreateSystemThread,7)
 	thread_tramp.ctx = ctx;
 	init_completion(&thread_tramp.started);
 
-	thread_tramp.thread->task = kthread_run(ntdriver_thread,
-						&thread_tramp, "ntdriver");
-	if (IS_ERR(thread_tramp.thread->task)) {
+	/* new task sets itself in thread (and adds thread to hash
+	 * tables) before signaling 'started' */
+	task = kthread_run(ntdriver_thread, &thread_tramp, "ntdriver");
+	if (IS_ERR(task)) {
 		free_object(thread_tramp.thread);
 		EXIT2(return STATUS_FAILURE);
 	}
-	TRACE2("created task: %p", thread_tramp.thread->task);
+	TRACE2("created task: %p", task);
 
 	wait_for_completion(&thread_tramp.started);
 	*handle = OBJECT_TO_HEADER(thread_tramp.thread);
@@ -1779,9 +2799,9 @@ struct mdl *allocate_init_mdl(void *virt, ULONG length)
 		wrap_mdl = kmem_cache_alloc(mdl_cache, irql_gfp());
 		if (!wrap_mdl)
 			return NULL;
-		spin_lock_bh(&dispatcher_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		InsertHeadList(&wrap_mdl_list, &wrap_mdl->list);
-		spin_unlock_bh(&dispatcher_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 		mdl = wrap_mdl->mdl;
 		TRACE3("allocated mdl from cache: %p(%p), %p(%d)",
 		       wrap_mdl, mdl, virt, length);
@@ -1798,9 +2818,9 @@ struct mdl *allocate_init_mdl(void *virt, ULONG length)
 		mdl = wrap_mdl->mdl;
 		TRACE3("allocated mdl from memory: %p(%p), %p(%d)",
 		       wrap_mdl, mdl, virt, length);
-		spin_lock_bh(&dispatcher_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		InsertHeadList(&wrap_mdl_list, &wrap_mdl->list);
-		spin_unlock_bh(&dispatcher_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 		memset(mdl, 0, mdl_size);
 		MmInitializeMdl(mdl, virt, length);
 		mdl->flags = MDL_ALLOCATED_FIXED_SIZE;
@@ -1822,9 +2842,9 @@ void free_mdl(struct mdl *mdl)
 	else {
 		struct wrap_mdl *wrap_mdl = (struct wrap_mdl *)
 			((char *)mdl - offsetof(struct wrap_mdl, mdl));
-		spin_lock_bh(&dispatcher_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		RemoveEntryList(&wrap_mdl->list);
-		spin_unlock_bh(&dispatcher_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 
 		if (mdl->flags & MDL_CACHE_ALLOCATED) {
 			TRACE3("freeing mdl cache: %p, %p, %p",
@@ -2487,22 +3507,35 @@ int ntoskernel_init(void)
 {
 	struct timeval now;
 
-	spin_lock_init(&dispatcher_lock);
+	do {
+		int i;
+		for (i = 0; i < DISPATCHER_LOCKS; i++) {
+			spin_lock_init(&dispatcher_locks[i]);
+			lockdep_set_class(&dispatcher_locks[i],
+					  &dispatcher_lock_keys[i]);
+		}
+	} while (0);
+	spin_lock_init(&wrap_mdl_lock);
+	pool_init();
+	spin_lock_init(&pool_tag_lock);
+	spin_lock_init(&lookaside_lock);
+	mutex_init(&lookaside_cache_mutex);
 	spin_lock_init(&ntoskernel_lock);
 	spin_lock_init(&ntos_work_lock);
-	spin_lock_init(&kdpc_list_lock);
 	spin_lock_init(&irp_cancel_lock);
 	InitializeListHead(&wrap_mdl_list);
-	InitializeListHead(&kdpc_list);
 	InitializeListHead(&callback_objects);
 	InitializeListHead(&bus_driver_list);
 	InitializeListHead(&object_list);
 	InitializeListHead(&ntos_work_list);
+	InitializeListHead(&lookaside_lists);
 
 	nt_spin_lock_init(&nt_list_lock);
 
-	INIT_WORK(&kdpc_work, kdpc_worker);
-	INIT_WORK(&ntos_work, ntos_work_worker);
+	INIT_WORK(&lookaside_work, lookaside_worker);
+	init_timer(&lookaside_timer);
+	lookaside_timer.function = lookaside_timer_proc;
+	lookaside_timer.data = 0;
 	wrap_timer_slist.next = NULL;
 
 	do_gettimeofday(&now);
@@ -2536,6 +3569,41 @@ int ntoskernel_init(void)
 		return -ENOMEM;
 	}
 	TRACE1("ntos_wq: %p", ntos_wq);
+	register_shrinker(&lookaside_shrinker);
+
+	do {
+		int cpu;
+		for_each_possible_cpu(cpu) {
+			struct kdpc_queue *kdpc_queue;
+			kdpc_queue = &per_cpu(kdpc_queues, cpu);
+			InitializeListHead(&kdpc_queue->list);
+			spin_lock_init(&kdpc_queue->lock);
+			INIT_WORK(&kdpc_queue->work, kdpc_worker);
+		}
+	} while (0);
+	/* one worker thread per cpu */
+	kdpc_wq = create_workqueue("kdpc_wq");
+	if (!kdpc_wq) {
+		WARNING("couldn't create kdpc_wq threads");
+		ntoskernel_exit();
+		return -ENOMEM;
+	}
+
+	do {
+		int cpu;
+		for_each_possible_cpu(cpu) {
+			struct ntos_work_queue *queue;
+			queue = &per_cpu(ntos_work_queues, cpu);
+			queue->draining = 0;
+			INIT_WORK(&queue->work, ntos_work_worker);
+		}
+	} while (0);
+	ntos_work_wq = create_workqueue("ntos_work_wq");
+	if (!ntos_work_wq) {
+		WARNING("couldn't create ntos_work_wq threads");
+		ntoskernel_exit();
+		return -ENOMEM;
+	}
 
 	if (add_bus_driver("PCI")
 #ifdef ENABLE_USB
@@ -2555,6 +3623,11 @@ int ntoskernel_init(void)
 		ntoskernel_exit();
 		return -ENOMEM;
 	}
+	if (irp_cache_init()) {
+		ERROR("couldn't allocate IRP caches");
+		ntoskernel_exit();
+		return -ENOMEM;
+	}
 
 #if defined(CONFIG_X86_64)
 	memset(&kuser_shared_data, 0, sizeof(kuser_shared_data));
@@ -2603,7 +3676,7 @@ void ntoskernel_exit(void)
 		if (!slist)
 			break;
 		wrap_timer = container_of(slist, struct wrap_timer, slist);
-		if (del_timer_sync(&wrap_timer->timer))
+		if (wrap_del_timer_sync(wrap_timer))
 			WARNING("Buggy Windows driver left timer %p running",
 				wrap_timer->nt_timer);
 		memset(wrap_timer, 0, sizeof(*wrap_timer));
@@ -2612,7 +3685,7 @@ void ntoskernel_exit(void)
 
 	TRACE2("freeing MDLs");
 	if (mdl_cache) {
-		spin_lock_bh(&ntoskernel_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		if (!IsListEmpty(&wrap_mdl_list))
 			ERROR("Windows driver didn't free all MDLs; "
 			      "freeing them now");
@@ -2624,7 +3697,7 @@ void ntoskernel_exit(void)
 			else
 				kfree(wrap_mdl);
 		}
-		spin_unlock_bh(&ntoskernel_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 		kmem_cache_destroy(mdl_cache);
 		mdl_cache = NULL;
 	}
@@ -2656,8 +3729,20 @@ void ntoskernel_exit(void)
 #if defined(CONFIG_X86_64)
 	del_timer_sync(&shared_data_timer);
 #endif
+	unregister_shrinker(&lookaside_shrinker);
+	del_timer_sync(&lookaside_timer);
+	if (kdpc_wq)
+		destroy_workqueue(kdpc_wq);
+	if (ntos_work_wq)
+		destroy_workqueue(ntos_work_wq);
 	if (ntos_wq)
 		destroy_workqueue(ntos_wq);
+	irp_cache_exit();
+	while (lookaside_cache_count > 0) {
+		struct lookaside_cache *lc;
+		lc = &lookaside_caches[--lookaside_cache_count];
+		kmem_cache_destroy(lc->cache);
+	}
 	ENTER2("freeing objects");
 	spin_lock_bh(&ntoskernel_lock);
 	while ((cur = RemoveHeadList(&object_list))) {
@@ -2672,6 +3757,9 @@ void ntoskernel_exit(void)
 		ExFreePool(hdr);
 	}
 	spin_unlock_bh(&ntoskernel_lock);
+	/* wait for threads freed with call_rcu */
+	rcu_barrier();
+	pool_exit();
 
 	EXIT2(return);
 }
@@ -18,6 +18,7 @@
 
 #include <linux/types.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/time.h>
 #include <linux/module.h>
 #include <linux/kmod.h>
@@ -46,6 +47,7 @@
 #include <linux/percpu.h>
 #include <linux/kthread.h>
 #include <linux/workqueue.h>
+#include <linux/mempool.h>
 
 #if !defined(CONFIG_X86) && !defined(CONFIG_X86_64)
 #error "this module is for x86 or x86_64 architectures only"
@@ -187,22 +189,25 @@ struct wrap_work_struct {
 	} while (0)
 
 #undef create_singlethread_workqueue
-#define create_singlethread_workqueue(wq) wrap_create_wq(wq, 1, 0)
+#define create_singlethread_workqueue(wq) wrap_create_wq(wq, 1, 0, 1)
 #undef create_workqueue
-#define create_workqueue(wq) wrap_create_wq(wq, 0, 0)
+#define create_workqueue(wq) wrap_create_wq(wq, 0, 0, 0)
 #undef destroy_workqueue
 #define destroy_workqueue(wq) wrap_destroy_wq(wq)
 #undef queue_work
 #define queue_work(wq, work) wrap_queue_work(wq, work)
 #undef flush_workqueue
 #define flush_workqueue(wq) wrap_flush_wq(wq)
+#undef queue_work_on
+#define queue_work_on(cpu, wq, work) wrap_queue_work(wq, work)
 
 struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
-					u8 freeze);
+					u8 freeze, int max_active);
 void wrap_destroy_wq(struct workqueue_struct *workq);
 int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work);
 void wrap_cancel_work(struct work_struct *work);
 void wrap_flush_wq(struct workqueue_struct *workq);
+int wrap_wq_stats(char *page, int count);
 
 #else // WRAP_WQ
 
@@ -219,6 +224,11 @@ static inline void (INIT_WORK)(struct work_struct *work, work_func_t func)
 #undef INIT_WORK
 #endif
 
+/* before 2.6.28, work is queued on current cpu */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
+#define queue_work_on(cpu, wq, work) queue_work(wq, work)
+#endif
+
 #endif // WRAP_WQ
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,18)
@@ -227,6 +237,17 @@ static inline void (INIT_WORK)(struct work_struct *work, work_func_t func)
 #define ISR_PT_REGS_PARAM_DECL , struct pt_regs *regs
 #endif
 
+/* interrupt DPCs can be run from threaded irq handler */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+#define WRAP_IRQ_THREAD 1
+#endif
+
+/* Windows timers are implemented with hrtimers, with slack for
+ * periodic timers; older kernels use (jiffies based) timer_list */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+#define WRAP_HRTIMER 1
+#endif
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,16)
 #define for_each_possible_cpu(_cpu) for_each_cpu(_cpu)
 #endif
@@ -392,9 +413,19 @@ struct ndis_mp_block;
 
 struct wrap_timer {
 	struct nt_slist slist;
+#ifdef WRAP_HRTIMER
+	struct hrtimer timer;
+	/* period and slack of periodic timer in ns */
+	u64 repeat;
+	unsigned long slack;
+	/* threads waiting on timer are woken from this DPC, as
+	 * dispatcher locks can't be taken in hard irq context */
+	struct kdpc wait_kdpc;
+#else
 	struct timer_list timer;
-	struct nt_timer *nt_timer;
 	long repeat;
+#endif
+	struct nt_timer *nt_timer;
 #ifdef TIMER_DEBUG
 	unsigned long wrap_timer_magic;
 #endif
@@ -405,8 +436,34 @@ struct ntos_work_item {
 	void *arg1;
 	void *arg2;
 	NTOS_WORK_FUNC func;
+	/* time (in ns) when queued */
+	unsigned long stamp;
 };
 
+/* work items are queued to per-cpu rings of preallocated items, each
+ * drained by ntos_work_wq's worker on that cpu; a producer claims a
+ * slot by advancing prod with cmpxchg and then publishes the item by
+ * setting func; items that don't fit in ring are allocated and added
+ * to a (global) overflow list */
+#define NTOS_WORK_RING_SIZE 64
+
+struct ntos_work_queue {
+	struct ntos_work_item ring[NTOS_WORK_RING_SIZE];
+	unsigned int prod;
+	unsigned int cons;
+	/* bit 0 is set while a worker consumes ring */
+	unsigned long draining;
+	struct work_struct work;
+	unsigned long queued;
+	unsigned long overflows;
+	unsigned long max_depth;
+	unsigned long runs;
+	u64 latency_total;
+	unsigned long latency_max;
+};
+
+DECLARE_PER_CPU(struct ntos_work_queue, ntos_work_queues);
+
 struct wrap_device_setting {
 	struct nt_list list;
 	char name[MAX_SETTING_NAME_LEN];
@@ -434,6 +491,9 @@ struct wrap_driver {
 	struct nt_list settings;
 	int dev_type;
 	struct ndis_driver *ndis_driver;
+	/* most urbs used at the same time by a device of this driver;
+	 * that many are preallocated for new devices */
+	int max_urbs;
 };
 
 enum hw_status {
@@ -468,6 +528,28 @@ struct wrap_device {
 			struct usb_interface *intf;
 			int num_alloc_urbs;
 			struct nt_list wrap_urb_list;
+			/* urbs in wrap_urb_list that are not in use */
+			nt_slist_header free_urbs;
+			NT_SPIN_LOCK free_urbs_lock;
+			atomic_t urbs_in_use;
+			int max_urbs_in_use;
+			unsigned long urb_alloc_misses;
+			/* DMA bounce buffers, per endpoint and direction */
+			struct wrap_bounce_pool *bounce_pools;
+			unsigned long sg_urbs;
+			/* completed urbs, processed by complete_work or,
+			 * if complete_inline is set, those of bulk or
+			 * interrupt irps submitted at DISPATCH_LEVEL, by
+			 * complete_tasklet */
+			struct nt_list complete_list;
+			spinlock_t complete_lock;
+			unsigned long completing;
+			struct work_struct complete_work;
+			struct tasklet_struct complete_tasklet;
+			int complete_inline;
+			unsigned long urbs_completed;
+			unsigned long urbs_completed_inline;
+			unsigned long max_complete_batch;
 		} usb;
 	};
 };
@@ -490,6 +572,7 @@ struct wrap_device {
 extern struct workqueue_struct *ntos_wq;
 extern struct workqueue_struct *ndis_wq;
 extern struct workqueue_struct *wrapndis_wq;
+extern struct workqueue_struct *wrapndis_tx_wq;
 
 #define atomic_unary_op(var, size, oper)				\
 do {									\
@@ -553,19 +636,24 @@ do {									\
  * a mutex instead, so that only ndiswrapper threads run one at a time
  * on a processor when at DISPATCH_LEVEL seems to be enough. So that
  * is what we will use until we learn otherwise. If
- * preempt_(en|dis)able is required for some reason, comment out
- * following #define. */
-
+ * preempt_(en|dis)able is required for some reason, build with
+ * "IRQL_PREEMPT=1", which defines WRAP_IRQL_PREEMPT; IRQL is then
+ * raised with local_bh_disable (which disables preempt). That is much
+ * cheaper than taking mutex and pinning the task to the processor,
+ * but neither Windows drivers nor wrapper may sleep at
+ * DISPATCH_LEVEL then. */
+
+#ifndef WRAP_IRQL_PREEMPT
 #define WRAP_PREEMPT 1
+#endif
 
-#if !defined(CONFIG_PREEMPT) || defined(CONFIG_PREEMPT_RT)
+/* Linux spinlocks used in DPCs etc. can sleep in RT kernels */
+#ifdef CONFIG_PREEMPT_RT
 #ifndef WRAP_PREEMPT
 #define WRAP_PREEMPT 1
 #endif
 #endif
 
-//#undef WRAP_PREEMPT
-
 #ifdef WRAP_PREEMPT
 
 struct irql_info {
@@ -645,12 +733,51 @@ static inline KIRQL current_irql(void)
 		EXIT6(return PASSIVE_LEVEL);
 }
 
+#define irql_gfp() (in_atomic() ? GFP_ATOMIC : GFP_KERNEL)
+
+#define IRQL_BACKEND "mutex"
+
 #else
 
+/* number of times IRQL has been raised to DISPATCH_LEVEL on a
+ * processor; since preempt is disabled while it is non-zero, it is
+ * also the nesting count of the task running on that processor */
+DECLARE_PER_CPU(int, irql_count);
+
+/* bottom halves are disabled at DISPATCH_LEVEL, as Windows code also
+ * runs in softirq context (e.g., tasklets completing urbs); otherwise
+ * it could interrupt a task holding an NT spinlock on the same
+ * processor and spin on that lock forever */
+static inline KIRQL raise_irql(KIRQL newirql)
+{
+	int count;
+
+	assert(newirql == DISPATCH_LEVEL);
+	assert(!in_irq());
+	local_bh_disable();
+	count = __get_cpu_var(irql_count)++;
+	return count ? DISPATCH_LEVEL : PASSIVE_LEVEL;
+}
+
+static inline void lower_irql(KIRQL oldirql)
+{
+	assert(oldirql <= DISPATCH_LEVEL);
+	assert(__get_cpu_var(irql_count) > 0);
+	__get_cpu_var(irql_count)--;
+	local_bh_enable();
+}
+
 static inline KIRQL current_irql(void)
 {
+	int count;
 	if (in_irq() || irqs_disabled())
 		EXIT4(return DIRQL);
+	/* checked before in_interrupt, as raise_irql disables
+	 * bottom halves */
+	count = get_cpu_var(irql_count);
+	put_cpu_var(irql_count);
+	if (count)
+		EXIT6(return DISPATCH_LEVEL);
 	if (in_interrupt())
 		EXIT4(return SOFT_IRQL);
 	if (in_atomic())
@@ -659,25 +786,12 @@ static inline KIRQL current_irql(void)
 		EXIT6(return PASSIVE_LEVEL);
 }
 
-static inline KIRQL raise_irql(KIRQL newirql)
-{
-	KIRQL ret = in_atomic() ? DISPATCH_LEVEL : PASSIVE_LEVEL;
-	assert(newirql == DISPATCH_LEVEL);
-	assert(current_irql() <= DISPATCH_LEVEL);
-	preempt_disable();
-	return ret;
-}
+#define irql_gfp() (current_irql() > PASSIVE_LEVEL ? GFP_ATOMIC : GFP_KERNEL)
 
-static inline void lower_irql(KIRQL oldirql)
-{
-	assert(current_irql() == DISPATCH_LEVEL);
-	preempt_enable();
-}
+#define IRQL_BACKEND "preempt"
 
 #endif
 
-#define irql_gfp() (in_atomic() ? GFP_ATOMIC : GFP_KERNEL)
-
 /* Windows spinlocks are of type ULONG_PTR which is not big enough to
  * store Linux spinlocks; so we implement Windows spinlocks using
  * ULONG_PTR space with our own functions/macros */
@@ -687,38 +801,101 @@ static inline void lower_irql(KIRQL oldirql)
  * crashes */
 
 #define NT_SPIN_LOCK_UNLOCKED 0
-#define NT_SPIN_LOCK_LOCKED 1
 
 static inline void nt_spin_lock_init(NT_SPIN_LOCK *lock)
 {
 	*lock = NT_SPIN_LOCK_UNLOCKED;
 }
 
+#ifdef SPINLOCK_STATS
+
+/* per-lock contention counters, kept in a table hashed by address of
+ * lock; see /proc/net/ndiswrapper/spinlocks */
+struct nt_spin_lock_stats {
+	NT_SPIN_LOCK *lock;
+	/* last caller that had to wait for the lock */
+	void *caller;
+	unsigned long acquired;
+	unsigned long contended;
+	unsigned long spins;
+	unsigned long max_spins;
+	cycles_t hold_start;
+	u64 hold_cycles;
+	cycles_t max_hold_cycles;
+};
+
+#define SPIN_LOCK_STATS_HASH_BITS 10
+#define SPIN_LOCK_STATS_SIZE (1 << SPIN_LOCK_STATS_HASH_BITS)
+
+extern struct nt_spin_lock_stats spin_lock_stats[SPIN_LOCK_STATS_SIZE];
+
+void nt_spin_lock_acquired(NT_SPIN_LOCK *lock, unsigned long spins,
+			   void *caller);
+void nt_spin_lock_releasing(NT_SPIN_LOCK *lock);
+
+#else
+
+#define nt_spin_lock_acquired(lock, spins, caller) do { } while (0)
+#define nt_spin_lock_releasing(lock) do { } while (0)
+
+#endif
+
 #ifdef CONFIG_SMP
 
-static inline void nt_spin_lock(NT_SPIN_LOCK *lock)
+/* Spinlocks are ticket locks in lower 32 bits of the lock: low 16
+ * bits are the ticket being served and high 16 bits the next ticket
+ * to give out, so processors get the lock in the order they asked for
+ * it. The lock is free when both are same; the last owner resets it
+ * to 0 when no one is waiting, so a free lock is (almost always) 0,
+ * as Windows expects */
+
+#define NT_SPIN_LOCK_TICKET (1 << 16)
+
+static inline u32 nt_spin_lock_xadd(NT_SPIN_LOCK *lock, u32 val)
 {
-	while (1) {
-		unsigned long lockval = xchg(lock, NT_SPIN_LOCK_LOCKED);
+	__asm__ __volatile__("lock; xaddl %0, %1"
+			     : "+r" (val), "+m" (*(u32 *)lock)
+			     : : "memory", "cc");
+	return val;
+}
 
-		if (likely(lockval == NT_SPIN_LOCK_UNLOCKED))
-			break;
-		if (unlikely(lockval > NT_SPIN_LOCK_LOCKED)) {
-			ERROR("bad spinlock: 0x%lx at %p", lockval, lock);
-			return;
+static inline void nt_spin_lock(NT_SPIN_LOCK *lock)
+{
+	u32 lockval;
+	u16 ticket;
+	unsigned long spins = 0;
+
+	lockval = nt_spin_lock_xadd(lock, NT_SPIN_LOCK_TICKET);
+	ticket = lockval >> 16;
+	if (unlikely((u16)lockval != ticket)) {
+		while (ACCESS_ONCE(*(u16 *)lock) != ticket) {
+			/* "rep; nop" doesn't change cx register, it's
+			 * a "pause" */
+			__asm__ __volatile__("rep; nop");
+			spins++;
 		}
-		/* "rep; nop" doesn't change cx register, it's a "pause" */
-		__asm__ __volatile__("rep; nop");
 	}
+	barrier();
+	nt_spin_lock_acquired(lock, spins, __builtin_return_address(0));
 }
 
 static inline void nt_spin_unlock(NT_SPIN_LOCK *lock)
 {
-	unsigned long lockval = xchg(lock, NT_SPIN_LOCK_UNLOCKED);
+	u32 lockval = ACCESS_ONCE(*(u32 *)lock);
 
-	if (likely(lockval == NT_SPIN_LOCK_LOCKED))
+	if (unlikely((u16)lockval == (u16)(lockval >> 16))) {
+		WARNING("unlocking unlocked spinlock: 0x%x at %p",
+			lockval, lock);
+		return;
+	}
+	nt_spin_lock_releasing(lock);
+	/* if no one is waiting, lock is reset to 0; otherwise, it is
+	 * handed to next ticket */
+	if ((u16)(lockval + 1) == (u16)(lockval >> 16) &&
+	    cmpxchg((u32 *)lock, lockval, NT_SPIN_LOCK_UNLOCKED) == lockval)
 		return;
-	WARNING("unlocking unlocked spinlock: 0x%lx at %p", lockval, lock);
+	__asm__ __volatile__("lock; incw %0"
+			     : "+m" (*(u16 *)lock) : : "memory", "cc");
 }
 
 #else // CONFIG_SMP
@@ -769,28 +946,63 @@ static inline ULONG SPAN_PAGES(void *ptr, SIZE_T length)
 		>> PAGE_SHIFT;
 }
 
+/* MDLs allocated from mdl_cache and NDIS buffer pools have room for
+ * MDL_CACHE_PAGES pages */
+#define MDL_CACHE_PAGES 3
+#define MDL_CACHE_SIZE (sizeof(struct mdl) + \
+			(sizeof(PFN_NUMBER) * MDL_CACHE_PAGES))
+
 #ifdef CONFIG_X86_64
 
-/* TODO: can these be implemented without using spinlock? */
+/* depth is in low 16 bits of 'align' and sequence number in the
+ * rest; sequence number is changed by every push and pop so that a
+ * head that was popped and pushed back in between is not mistaken
+ * for unchanged head (ABA problem) */
+#define SLIST_DEPTH_MASK 0xffffULL
+#define SLIST_SEQUENCE_INC 0x10000ULL
 
-static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
-					      struct nt_slist *entry,
-					      NT_SPIN_LOCK *lock)
+static inline int nt_cmpxchg16b(nt_slist_header *head, nt_slist_header *old,
+				nt_slist_header *new)
+{
+	char ret;
+
+	__asm__ __volatile__(
+		"\n"
+		LOCK_PREFIX "cmpxchg16b %1\n"
+		"setz %0\n"
+		: "=qm" (ret), "+m" (*head),
+		  "+a" (old->align), "+d" (old->region)
+		: "b" (new->align), "c" (new->region)
+		: "memory", "cc");
+	return ret;
+}
+
+/* processors without cmpxchg16b (some early x86_64) use spinlock */
+
+static inline struct nt_slist *slist_push_locked(nt_slist_header *head,
+						 struct nt_slist *entry,
+						 NT_SPIN_LOCK *lock)
 {
-	KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
-	entry->next = head->next;
+	struct nt_slist *next;
+	KIRQL irql;
+
+	irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
+	next = head->next;
+	entry->next = next;
 	head->next = entry;
 	head->depth++;
 	nt_spin_unlock_irql(lock, irql);
-	TRACE4("%p, %p, %p", head, entry, entry->next);
-	return entry->next;
+	TRACE4("%p, %p, %p", head, entry, next);
+	return next;
 }
 
-static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
-					     NT_SPIN_LOCK *lock)
+static inline struct nt_slist *slist_pop_locked(nt_slist_header *head,
+						NT_SPIN_LOCK *lock)
 {
 	struct nt_slist *entry;
-	KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
+	KIRQL irql;
+
+	irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
 	entry = head->next;
 	if (entry) {
 		head->next = entry->next;
@@ -801,6 +1013,50 @@ static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
 	return entry;
 }
 
+static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
+					      struct nt_slist *entry,
+					      NT_SPIN_LOCK *lock)
+{
+	nt_slist_header old, new;
+
+	if (unlikely(!boot_cpu_has(X86_FEATURE_CX16)))
+		return slist_push_locked(head, entry, lock);
+	do {
+		old.align = ACCESS_ONCE(head->align);
+		old.region = ACCESS_ONCE(head->region);
+		entry->next = old.next;
+		new.next = entry;
+		new.align = ((old.align + SLIST_SEQUENCE_INC) &
+			     ~SLIST_DEPTH_MASK) |
+			((old.align + 1) & SLIST_DEPTH_MASK);
+	} while (!nt_cmpxchg16b(head, &old, &new));
+	TRACE4("%p, %p, %p", head, entry, old.next);
+	return old.next;
+}
+
+static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
+					     NT_SPIN_LOCK *lock)
+{
+	struct nt_slist *entry;
+	nt_slist_header old, new;
+
+	if (unlikely(!boot_cpu_has(X86_FEATURE_CX16)))
+		return slist_pop_locked(head, lock);
+	do {
+		old.align = ACCESS_ONCE(head->align);
+		old.region = ACCESS_ONCE(head->region);
+		entry = old.next;
+		if (!entry)
+			break;
+		new.next = entry->next;
+		new.align = ((old.align + SLIST_SEQUENCE_INC) &
+			     ~SLIST_DEPTH_MASK) |
+			((old.align - 1) & SLIST_DEPTH_MASK);
+	} while (!nt_cmpxchg16b(head, &old, &new));
+	TRACE4("%p, %p", head, entry);
+	return entry;
+}
+
 #else
 
 #define u64_low_32(x) ((u32)x)
@@ -819,7 +1075,9 @@ static inline u64 nt_cmpxchg8b(volatile u64 *ptr, u64 old, u64 new)
 }
 
 /* slist routines below update slist atomically - no need for
- * spinlocks */
+ * spinlocks; sequence number is changed by every push and pop so
+ * that a head that was popped and pushed back in between is not
+ * mistaken for unchanged head (ABA problem) */
 
 static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 					      struct nt_slist *entry,
@@ -831,6 +1089,7 @@ static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 		entry->next = old.next;
 		new.next = entry;
 		new.depth = old.depth + 1;
+		new.sequence = old.sequence + 1;
 	} while (nt_cmpxchg8b(&head->align, old.align, new.align) != old.align);
 	TRACE4("%p, %p, %p", head, entry, old.next);
 	return old.next;
@@ -848,6 +1107,7 @@ static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
 			break;
 		new.next = entry->next;
 		new.depth = old.depth - 1;
+		new.sequence = old.sequence + 1;
 	} while (nt_cmpxchg8b(&head->align, old.align, new.align) != old.align);
 	TRACE4("%p, %p", head, entry);
 	return entry;
@@ -871,9 +1131,14 @@ void *allocate_object(ULONG size, enum common_object_type type,
 #ifdef ENABLE_USB
 int usb_init(void);
 void usb_exit(void);
+int usb_stats(struct wrap_device *wd, char *page, int count);
 #else
 static inline int usb_init(void) { return 0; }
 static inline void usb_exit(void) {}
+static inline int usb_stats(struct wrap_device *wd, char *page, int count)
+{
+	return 0;
+}
 #endif
 int usb_init_device(struct wrap_device *wd);
 void usb_exit_device(struct wrap_device *wd);
@@ -894,8 +1159,14 @@ u64 ticks_1601(void);
 int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2);
 void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 		     struct ndis_mp_block *nmb);
-BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
-		       unsigned long repeat_hz, struct kdpc *kdpc);
+BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, u64 expires_ticks,
+		       u64 repeat_ticks, struct kdpc *kdpc);
+int wrap_del_timer_sync(struct wrap_timer *wrap_timer);
+
+/* how late timers expire: <1us, <2us, <4us, ..., >=1024us */
+#define TIMER_LATE_HIST_SIZE 12
+extern unsigned long timer_late_hist[TIMER_LATE_HIST_SIZE];
+extern unsigned long timer_late_max;
 
 LONG InterlockedDecrement(LONG volatile *val) wfastcall;
 LONG InterlockedIncrement(LONG volatile *val) wfastcall;
@@ -926,6 +1197,46 @@ void *(ExAllocatePoolWithTag)(enum pool_type pool_type, SIZE_T size,
 			      ULONG tag) wstdcall;
 
 void ExFreePool(void *p) wstdcall;
+void *pool_block_base(void *addr);
+
+/* pool allocations accounted by tag, in a table hashed by tag; see
+ * /proc/net/ndiswrapper/pool */
+struct pool_tag_stats {
+	ULONG tag;
+	int used;
+	atomic_long_t allocs;
+	atomic_long_t frees;
+	atomic_long_t failed;
+	atomic_long_t live_bytes;
+	atomic_long_t max_live_bytes;
+};
+
+#define POOL_TAG_HASH_BITS 7
+#define POOL_TAGS (1 << POOL_TAG_HASH_BITS)
+
+extern struct pool_tag_stats pool_tag_stats[POOL_TAGS];
+extern atomic_long_t pool_page_blocks, pool_vmalloc_blocks, pool_pow2_blocks;
+
+/* IRPs allocated with IoAllocateIrp are taken from a cache for each
+ * stack count, backed by a mempool so allocations at DISPATCH_LEVEL
+ * don't fail under memory pressure; see /proc/net/ndiswrapper/irps */
+struct irp_cache {
+	struct kmem_cache *cache;
+	mempool_t *pool;
+	char name[24];
+	atomic_long_t allocs;
+	atomic_long_t frees;
+	atomic_long_t failed;
+};
+
+#define IRP_CACHE_STACKS 8
+#define IRP_CACHE_RESERVE 4
+
+extern struct irp_cache irp_caches[IRP_CACHE_STACKS];
+extern atomic_long_t irp_kmalloc_allocs;
+int irp_cache_init(void);
+void irp_cache_exit(void);
+
 ULONG MmSizeOfMdl(void *base, ULONG length) wstdcall;
 void __iomem *MmMapIoSpace(PHYSICAL_ADDRESS phys_addr, SIZE_T size,
 		   enum memory_caching_type cache) wstdcall;
@@ -940,7 +1251,14 @@ LONG KeSetEvent(struct nt_event *nt_event, KPRIORITY incr,
 LONG KeResetEvent(struct nt_event *nt_event) wstdcall;
 BOOLEAN queue_kdpc(struct kdpc *kdpc);
 BOOLEAN dequeue_kdpc(struct kdpc *kdpc);
-
+BOOLEAN queue_interrupt_dpc(struct kinterrupt *interrupt, struct kdpc *kdpc);
+
+NTSTATUS connect_interrupt(struct kinterrupt **kinterrupt,
+			   PKSERVICE_ROUTINE isr, void *isr_ctx,
+			   NT_SPIN_LOCK *lock, ULONG vector, KIRQL irql,
+			   KIRQL synch_irql, enum kinterrupt_mode mode,
+			   BOOLEAN shared, KAFFINITY cpu_mask, BOOLEAN save_fp,
+			   struct kdpc *thread_dpc);
 NTSTATUS IoConnectInterrupt(struct kinterrupt **kinterrupt,
 			    PKSERVICE_ROUTINE service_routine,
 			    void *service_context, NT_SPIN_LOCK *lock,
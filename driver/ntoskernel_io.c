@@ -55,16 +55,37 @@ wstdcall BOOLEAN WIN_FUNC(IoIs32bitProcess,1)
 #endif
 }
 
-wstdcall void WIN_FUNC(IoInitializeIrp,3)
-	(struct irp *irp, USHORT size, CCHAR stack_count)
-{
-	IOENTER("irp: %p, %d, %d", irp, size, stack_count);
+struct irp_cache irp_caches[IRP_CACHE_STACKS];
+atomic_long_t irp_kmalloc_allocs;
 
+/* irps allocated by IoAllocateIrp are preceded by this header, which
+ * records where the memory came from; drivers may reinitialize irp
+ * with IoInitializeIrp, which clears alloc_flags, but not this */
+struct irp_alloc_hdr {
+	/* NULL if kmalloc'ed */
+	struct irp_cache *cache;
+	/* keeps irp aligned as kmalloc'ed memory is */
+	void *pad;
+};
+
+#define IRP_ALLOC_HDR(irp) ((struct irp_alloc_hdr *)(irp) - 1)
+
+static inline void init_irp(struct irp *irp, USHORT size, CCHAR stack_count,
+			    UCHAR alloc_flags)
+{
 	memset(irp, 0, size);
 	irp->size = size;
 	irp->stack_count = stack_count;
 	irp->current_location = stack_count;
 	IoGetCurrentIrpStackLocation(irp) = IRP_SL(irp, stack_count);
+	irp->alloc_flags = alloc_flags;
+}
+
+wstdcall void WIN_FUNC(IoInitializeIrp,3)
+	(struct irp *irp, USHORT size, CCHAR stack_count)
+{
+	IOENTER("irp: %p, %d, %d", irp, size, stack_count);
+	init_irp(irp, size, stack_count, 0);
 	IOEXIT(return);
 }
 
@@ -73,11 +94,7 @@ wstdcall void WIN_FUNC(IoReuseIrp,2)
 {
 	IOENTER("%p, %d", irp, status);
 	if (irp) {
-		UCHAR alloc_flags;
-
-		alloc_flags = irp->alloc_flags;
-		IoInitializeIrp(irp, irp->size, irp->stack_count);
-		irp->alloc_flags = alloc_flags;
+		init_irp(irp, irp->size, irp->stack_count, irp->alloc_flags);
 		irp->io_status.status = status;
 	}
 	IOEXIT(return);
@@ -86,15 +103,34 @@ wstdcall void WIN_FUNC(IoReuseIrp,2)
 wstdcall struct irp *WIN_FUNC(IoAllocateIrp,2)
 	(char stack_count, BOOLEAN charge_quota)
 {
+	struct irp_cache *irp_cache;
+	struct irp_alloc_hdr *hdr;
 	struct irp *irp;
 	int irp_size;
 
 	IOENTER("count: %d", stack_count);
 	stack_count++;
 	irp_size = IoSizeOfIrp(stack_count);
-	irp = kmalloc(irp_size, irql_gfp());
-	if (irp)
-		IoInitializeIrp(irp, irp_size, stack_count);
+	if (stack_count <= IRP_CACHE_STACKS &&
+	    irp_caches[stack_count - 1].pool) {
+		irp_cache = &irp_caches[stack_count - 1];
+		hdr = mempool_alloc(irp_cache->pool, irql_gfp());
+		if (hdr)
+			atomic_long_inc(&irp_cache->allocs);
+		else
+			atomic_long_inc(&irp_cache->failed);
+	} else {
+		irp_cache = NULL;
+		hdr = kmalloc(sizeof(*hdr) + irp_size, irql_gfp());
+		if (hdr)
+			atomic_long_inc(&irp_kmalloc_allocs);
+	}
+	if (!hdr)
+		IOEXIT(return NULL);
+	hdr->cache = irp_cache;
+	irp = (struct irp *)(hdr + 1);
+	init_irp(irp, irp_size, stack_count,
+		 irp_cache ? IRP_LOOKASIDE_ALLOCATION : 0);
 	IOTRACE("irp %p", irp);
 	IOEXIT(return irp);
 }
@@ -169,6 +205,8 @@ wstdcall void IoDequeueThreadIrp(struct irp *irp)
 wstdcall void WIN_FUNC(IoFreeIrp,1)
 	(struct irp *irp)
 {
+	struct irp_alloc_hdr *hdr;
+
 	IOENTER("irp = %p", irp);
 	if (!irp) {
 		WARNING("irp is NULL");
@@ -178,11 +216,57 @@ wstdcall void WIN_FUNC(IoFreeIrp,1)
 	if (irp->flags & IRP_SYNCHRONOUS_API)
 		IoDequeueThreadIrp(irp);
 	IoCancelIrp(irp);
-	kfree(irp);
+	hdr = IRP_ALLOC_HDR(irp);
+	if (hdr->cache) {
+		atomic_long_inc(&hdr->cache->frees);
+		mempool_free(hdr, hdr->cache->pool);
+	} else
+		kfree(hdr);
 
 	IOEXIT(return);
 }
 
+int irp_cache_init(void)
+{
+	struct irp_cache *irp_cache;
+	int i;
+
+	for (i = 0; i < IRP_CACHE_STACKS; i++) {
+		irp_cache = &irp_caches[i];
+		snprintf(irp_cache->name, sizeof(irp_cache->name),
+			 DRIVER_NAME "_irp_%d", i + 1);
+		irp_cache->cache =
+			wrap_kmem_cache_create(irp_cache->name,
+					       sizeof(struct irp_alloc_hdr) +
+					       IoSizeOfIrp(i + 1), 0, 0);
+		if (!irp_cache->cache)
+			return -ENOMEM;
+		irp_cache->pool = mempool_create_slab_pool(IRP_CACHE_RESERVE,
+							   irp_cache->cache);
+		if (!irp_cache->pool)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+void irp_cache_exit(void)
+{
+	struct irp_cache *irp_cache;
+	int i;
+
+	for (i = 0; i < IRP_CACHE_STACKS; i++) {
+		irp_cache = &irp_caches[i];
+		if (irp_cache->pool) {
+			mempool_destroy(irp_cache->pool);
+			irp_cache->pool = NULL;
+		}
+		if (irp_cache->cache) {
+			kmem_cache_destroy(irp_cache->cache);
+			irp_cache->cache = NULL;
+		}
+	}
+}
+
 wstdcall struct irp *WIN_FUNC(IoBuildAsynchronousFsdRequest,6)
 	(ULONG major_fn, struct device_object *dev_obj, void *buffer,
 	 ULONG length, LARGE_INTEGER *offset,
@@ -542,20 +626,62 @@ static irqreturn_t io_irq_isr(int irq, void *data ISR_PT_REGS_PARAM_DECL)
 	nt_spin_lock(interrupt->actual_lock);
 	ret = LIN2WIN2(interrupt->isr, interrupt, interrupt->isr_ctx);
 	nt_spin_unlock(interrupt->actual_lock);
-	if (ret == TRUE)
+	if (ret == TRUE) {
+#ifdef WRAP_IRQ_THREAD
+		if (test_bit(0, &interrupt->thread_dpc_pending))
+			EXIT6(return IRQ_WAKE_THREAD);
+#endif
 		EXIT6(return IRQ_HANDLED);
-	else
+	} else
 		EXIT6(return IRQ_NONE);
 }
 
-wstdcall NTSTATUS WIN_FUNC(IoConnectInterrupt,11)
-	(struct kinterrupt **kinterrupt, PKSERVICE_ROUTINE isr, void *isr_ctx,
-	 NT_SPIN_LOCK *lock, ULONG vector, KIRQL irql, KIRQL synch_irql,
-	 enum kinterrupt_mode mode, BOOLEAN shared, KAFFINITY cpu_mask,
-	 BOOLEAN save_fp)
+#ifdef WRAP_IRQ_THREAD
+/* irq thread is woken up directly from io_irq_isr, so thread_dpc runs
+ * without going through kdpc_wq; the thread runs in process context,
+ * so DPC can be run at DISPATCH_LEVEL as usual */
+static irqreturn_t io_irq_thread(int irq, void *data)
+{
+	struct kinterrupt *interrupt = data;
+	struct kdpc *kdpc = interrupt->thread_dpc;
+	KIRQL irql;
+
+	TRACE6("%p", interrupt);
+	if (!test_and_clear_bit(0, &interrupt->thread_dpc_pending))
+		EXIT6(return IRQ_HANDLED);
+	irql = raise_irql(DISPATCH_LEVEL);
+	LIN2WIN4(kdpc->func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
+	assert_irql(_irql_ == DISPATCH_LEVEL);
+	lower_irql(irql);
+	EXIT6(return IRQ_HANDLED);
+}
+#endif
+
+/* called by ISR to queue DPC; if the DPC is interrupt's thread_dpc,
+ * it is run by irq thread after ISR returns */
+BOOLEAN queue_interrupt_dpc(struct kinterrupt *interrupt, struct kdpc *kdpc)
+{
+#ifdef WRAP_IRQ_THREAD
+	/* ISR may also be called outside of io_irq_isr (e.g., netpoll),
+	 * in which case irq thread is not woken up */
+	if (interrupt->thread_dpc == kdpc && in_irq())
+		return !test_and_set_bit(0, &interrupt->thread_dpc_pending);
+#endif
+	return queue_kdpc(kdpc);
+}
+
+/* IoConnectInterrupt with optional DPC run from irq thread */
+NTSTATUS connect_interrupt(struct kinterrupt **kinterrupt,
+			   PKSERVICE_ROUTINE isr, void *isr_ctx,
+			   NT_SPIN_LOCK *lock, ULONG vector, KIRQL irql,
+			   KIRQL synch_irql, enum kinterrupt_mode mode,
+			   BOOLEAN shared, KAFFINITY cpu_mask, BOOLEAN save_fp,
+			   struct kdpc *thread_dpc)
 {
 	struct kinterrupt *interrupt;
-	IOENTER("");
+	int ret;
+
+	IOENTER("%p", thread_dpc);
 	interrupt = kzalloc(sizeof(*interrupt), GFP_KERNEL);
 	if (!interrupt)
 		IOEXIT(return STATUS_INSUFFICIENT_RESOURCES);
@@ -574,9 +700,18 @@ wstdcall NTSTATUS WIN_FUNC(IoConnectInterrupt,11)
 	interrupt->irql = irql;
 	interrupt->synch_irql = synch_irql;
 	interrupt->mode = mode;
-	if (request_irq(vector, io_irq_isr, shared ? IRQF_SHARED : 0,
-			DRIVER_NAME, interrupt)) {
-		WARNING("request for irq %d failed", vector);
+#ifdef WRAP_IRQ_THREAD
+	interrupt->thread_dpc = thread_dpc;
+	if (thread_dpc)
+		ret = request_threaded_irq(vector, io_irq_isr, io_irq_thread,
+					   shared ? IRQF_SHARED : 0,
+					   DRIVER_NAME, interrupt);
+	else
+#endif
+		ret = request_irq(vector, io_irq_isr, shared ? IRQF_SHARED : 0,
+				  DRIVER_NAME, interrupt);
+	if (ret) {
+		WARNING("request for irq %d failed: %d", vector, ret);
 		kfree(interrupt);
 		IOEXIT(return STATUS_INSUFFICIENT_RESOURCES);
 	}
@@ -587,6 +722,17 @@ wstdcall NTSTATUS WIN_FUNC(IoConnectInterrupt,11)
 	IOEXIT(return STATUS_SUCCESS);
 }
 
+wstdcall NTSTATUS WIN_FUNC(IoConnectInterrupt,11)
+	(struct kinterrupt **kinterrupt, PKSERVICE_ROUTINE isr, void *isr_ctx,
+	 NT_SPIN_LOCK *lock, ULONG vector, KIRQL irql, KIRQL synch_irql,
+	 enum kinterrupt_mode mode, BOOLEAN shared, KAFFINITY cpu_mask,
+	 BOOLEAN save_fp)
+{
+	return connect_interrupt(kinterrupt, isr, isr_ctx, lock, vector, irql,
+				 synch_irql, mode, shared, cpu_mask, save_fp,
+				 NULL);
+}
+
 wstdcall void WIN_FUNC(IoDisconnectInterrupt,1)
 	(struct kinterrupt *interrupt)
 {
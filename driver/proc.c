@@ -23,6 +23,14 @@
 #include "wrapper.h"
 
 #define MAX_PROC_STR_LEN 32
+/* number of raise_irql/lower_irql pairs timed when 'irql' is read */
+#define IRQL_BENCH_PAIRS 10000
+/* when 'slist' is read, each cpu pops up to SLIST_TEST_BATCH entries
+ * from a list of SLIST_TEST_ENTRIES and pushes them back,
+ * SLIST_TEST_ROUNDS times */
+#define SLIST_TEST_ROUNDS 100000
+#define SLIST_TEST_ENTRIES 256
+#define SLIST_TEST_BATCH 8
 
 static struct proc_dir_entry *wrap_procfs_entry;
 
@@ -250,6 +258,91 @@ static int procfs_read_ndis_hw(char *page, char **start, off_t off,
 	return p - page;
 }
 
+static int procfs_read_ndis_tx(char *page, char **start, off_t off,
+			       int count, int *eof, void *data)
+{
+	char *p = page;
+	struct ndis_device *wnd = (struct ndis_device *)data;
+	char *batch_size[TX_BATCH_HIST_SIZE] = {"1", "2-3", "4-7", "8-15",
+						"16+"};
+	unsigned long batches;
+	int i;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	p += sprintf(p, "ring_size=%u\n", wnd->tx_ring_size);
+	p += sprintf(p, "ring_used=%u\n", wnd->tx_ring ? tx_ring_used(wnd) : 0);
+	p += sprintf(p, "ring_stop=%u\n", wnd->tx_ring_stop);
+	p += sprintf(p, "ring_wake=%u\n", wnd->tx_ring_wake);
+	p += sprintf(p, "max_tx_packets=%u\n", wnd->max_tx_packets);
+	batches = 0;
+	for (i = 0; i < TX_BATCH_HIST_SIZE; i++) {
+		p += sprintf(p, "batch_%s=%lu\n", batch_size[i],
+			     wnd->tx_batch_hist[i]);
+		batches += wnd->tx_batch_hist[i];
+	}
+	p += sprintf(p, "batches=%lu\n", batches);
+	p += sprintf(p, "batch_packets=%lu\n", wnd->tx_batch_packets);
+	p += sprintf(p, "direct=%d\n", wnd->tx_direct);
+	p += sprintf(p, "direct_packets=%lu\n", wnd->tx_direct_packets);
+	p += sprintf(p, "direct_requeued=%lu\n", wnd->tx_direct_requeued);
+
+	if (p - page > count) {
+		WARNING("wrote %td bytes (limit is %u)",
+			p - page, count);
+		*eof = 1;
+	}
+
+	return p - page;
+}
+
+static int procfs_read_ndis_irq(char *page, char **start, off_t off,
+				int count, int *eof, void *data)
+{
+	char *p = page;
+	struct ndis_device *wnd = (struct ndis_device *)data;
+	int i;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	p += sprintf(p, "irq=%d\n",
+		     wnd->mp_interrupt ? wnd->mp_interrupt->irq : -1);
+	p += sprintf(p, "mode=%s\n", wnd->irq_thread ? "thread" : "dpc");
+	p += sprintf(p, "handled=%lu\n", wnd->irq_dpc_count);
+	for (i = 0; i < IRQ_LATENCY_HIST_SIZE - 1; i++)
+		p += sprintf(p, "latency_under_%uus=%lu\n", 1 << i,
+			     wnd->irq_latency_hist[i]);
+	p += sprintf(p, "latency_%uus+=%lu\n", 1 << (i - 1),
+		     wnd->irq_latency_hist[i]);
+	p += sprintf(p, "latency_max_us=%lu\n", wnd->irq_latency_max);
+
+	if (p - page > count) {
+		WARNING("wrote %td bytes (limit is %u)",
+			p - page, count);
+		*eof = 1;
+	}
+
+	return p - page;
+}
+
+static int procfs_read_ndis_usb(char *page, char **start, off_t off,
+				int count, int *eof, void *data)
+{
+	struct ndis_device *wnd = (struct ndis_device *)data;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+	return usb_stats(wnd->wd, page, count);
+}
+
 static int procfs_read_ndis_settings(char *page, char **start, off_t off,
 				     int count, int *eof, void *data)
 {
@@ -448,8 +541,53 @@ int wrap_procfs_add_ndis_device(struct ndis_device *wnd)
 		procfs_entry->read_proc = procfs_read_ndis_settings;
 		procfs_entry->write_proc = procfs_write_ndis_settings;
 	}
+
+	procfs_entry = create_proc_entry("tx", S_IFREG | S_IRUSR | S_IRGRP,
+					 wnd->procfs_iface);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'tx'");
+		goto err_tx;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->data = wnd;
+		procfs_entry->read_proc = procfs_read_ndis_tx;
+	}
+
+	procfs_entry = create_proc_entry("irq", S_IFREG | S_IRUSR | S_IRGRP,
+					 wnd->procfs_iface);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'irq'");
+		goto err_irq;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->data = wnd;
+		procfs_entry->read_proc = procfs_read_ndis_irq;
+	}
+
+	if (wrap_is_usb_bus(wnd->wd->dev_bus)) {
+		procfs_entry = create_proc_entry("usb",
+						 S_IFREG | S_IRUSR | S_IRGRP,
+						 wnd->procfs_iface);
+		if (procfs_entry == NULL) {
+			ERROR("couldn't create proc entry for 'usb'");
+			goto err_usb;
+		} else {
+			procfs_entry->uid = proc_uid;
+			procfs_entry->gid = proc_gid;
+			procfs_entry->data = wnd;
+			procfs_entry->read_proc = procfs_read_ndis_usb;
+		}
+	}
 	return 0;
 
+err_usb:
+	remove_proc_entry("irq", wnd->procfs_iface);
+err_irq:
+	remove_proc_entry("tx", wnd->procfs_iface);
+err_tx:
+	remove_proc_entry("settings", wnd->procfs_iface);
 err_settings:
 	remove_proc_entry("encr", wnd->procfs_iface);
 err_encr:
@@ -472,6 +610,10 @@ void wrap_procfs_remove_ndis_device(struct ndis_device *wnd)
 	remove_proc_entry("stats", procfs_iface);
 	remove_proc_entry("encr", procfs_iface);
 	remove_proc_entry("settings", procfs_iface);
+	remove_proc_entry("tx", procfs_iface);
+	remove_proc_entry("irq", procfs_iface);
+	if (wrap_is_usb_bus(wnd->wd->dev_bus))
+		remove_proc_entry("usb", procfs_iface);
 	if (wrap_procfs_entry)
 		remove_proc_entry(procfs_iface->name, wrap_procfs_entry);
 }
@@ -524,6 +666,402 @@ static int procfs_write_debug(struct file *file, const char __user *buf,
 	return count;
 }
 
+/* cost of raising IRQL to DISPATCH_LEVEL and lowering it back, from
+ * PASSIVE_LEVEL and when already at DISPATCH_LEVEL */
+static int procfs_read_irql(char *page, char **start, off_t off,
+			    int count, int *eof, void *data)
+{
+	char *p = page;
+	KIRQL irql, nested_irql;
+	ktime_t t1, t2, t3;
+	int i;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	t1 = ktime_get();
+	for (i = 0; i < IRQL_BENCH_PAIRS; i++) {
+		irql = raise_irql(DISPATCH_LEVEL);
+		lower_irql(irql);
+	}
+	t2 = ktime_get();
+	irql = raise_irql(DISPATCH_LEVEL);
+	for (i = 0; i < IRQL_BENCH_PAIRS; i++) {
+		nested_irql = raise_irql(DISPATCH_LEVEL);
+		lower_irql(nested_irql);
+	}
+	lower_irql(irql);
+	t3 = ktime_get();
+
+	p += sprintf(p, "backend=%s\n", IRQL_BACKEND);
+	p += sprintf(p, "pairs=%d\n", IRQL_BENCH_PAIRS);
+	p += sprintf(p, "raise_lower_ns=%lu\n",
+		     (unsigned long)ktime_to_ns(ktime_sub(t2, t1)) /
+		     IRQL_BENCH_PAIRS);
+	p += sprintf(p, "nested_raise_lower_ns=%lu\n",
+		     (unsigned long)ktime_to_ns(ktime_sub(t3, t2)) /
+		     IRQL_BENCH_PAIRS);
+	return p - page;
+}
+
+struct slist_test_entry {
+	struct nt_slist slist;
+	/* set while entry is popped */
+	atomic_t owned;
+};
+
+struct slist_test {
+	nt_slist_header head;
+	NT_SPIN_LOCK lock;
+	/* use spinlock fallback instead of cmpxchg16b */
+	int locked;
+	atomic_t errors;
+	struct completion done;
+	struct slist_test_entry entries[SLIST_TEST_ENTRIES];
+};
+
+static struct slist_test slist_test;
+static DEFINE_MUTEX(slist_test_mutex);
+
+static struct nt_slist *slist_test_pop(struct slist_test *test)
+{
+#ifdef CONFIG_X86_64
+	if (test->locked)
+		return slist_pop_locked(&test->head, &test->lock);
+#endif
+	return PopEntrySList(&test->head, &test->lock);
+}
+
+static void slist_test_push(struct slist_test *test, struct nt_slist *slist)
+{
+#ifdef CONFIG_X86_64
+	if (test->locked) {
+		slist_push_locked(&test->head, slist, &test->lock);
+		return;
+	}
+#endif
+	PushEntrySList(&test->head, slist, &test->lock);
+}
+
+static int slist_test_thread(void *data)
+{
+	struct slist_test *test = data;
+	struct slist_test_entry *batch[SLIST_TEST_BATCH];
+	struct nt_slist *slist;
+	int i, n, round;
+
+	for (round = 0; round < SLIST_TEST_ROUNDS; round++) {
+		for (n = 0; n < round % SLIST_TEST_BATCH + 1; n++) {
+			slist = slist_test_pop(test);
+			if (!slist)
+				break;
+			batch[n] = container_of(slist, struct slist_test_entry,
+						slist);
+			/* entry popped again before it was pushed back */
+			if (atomic_xchg(&batch[n]->owned, 1))
+				atomic_inc(&test->errors);
+		}
+		for (i = 0; i < n; i++) {
+			atomic_set(&batch[i]->owned, 0);
+			slist_test_push(test, &batch[i]->slist);
+		}
+		if ((round % 1024) == 0)
+			cond_resched();
+	}
+	complete_and_exit(&test->done, 0);
+}
+
+/* runs slist_test_thread on all cpus; then all entries must be in the
+ * list exactly once and depth must match; returns number of errors */
+static int slist_test_run(struct slist_test *test, int locked)
+{
+	struct slist_test_entry *entry;
+	struct task_struct *task;
+	struct nt_slist *slist;
+	int i, n, cpu;
+
+	memset(&test->head, 0, sizeof(test->head));
+	nt_spin_lock_init(&test->lock);
+	test->locked = locked;
+	atomic_set(&test->errors, 0);
+	init_completion(&test->done);
+	for (i = 0; i < SLIST_TEST_ENTRIES; i++) {
+		atomic_set(&test->entries[i].owned, 0);
+		slist_test_push(test, &test->entries[i].slist);
+	}
+
+	n = 0;
+	for_each_online_cpu(cpu) {
+		task = kthread_create(slist_test_thread, test,
+				      "slist_test/%d", cpu);
+		if (IS_ERR(task)) {
+			WARNING("couldn't start thread on cpu %d", cpu);
+			continue;
+		}
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		n++;
+	}
+	while (n-- > 0)
+		wait_for_completion(&test->done);
+
+	n = 0;
+	for (slist = test->head.next; slist && n <= SLIST_TEST_ENTRIES;
+	     slist = slist->next) {
+		entry = container_of(slist, struct slist_test_entry, slist);
+		if (entry < test->entries ||
+		    entry >= test->entries + SLIST_TEST_ENTRIES) {
+			atomic_inc(&test->errors);
+			break;
+		}
+		/* entry is in the list more than once */
+		if (atomic_xchg(&entry->owned, 1))
+			atomic_inc(&test->errors);
+		n++;
+	}
+	if (n != SLIST_TEST_ENTRIES) {
+		WARNING("%d entries in list instead of %d", n,
+			SLIST_TEST_ENTRIES);
+		atomic_inc(&test->errors);
+	}
+	if (test->head.depth != SLIST_TEST_ENTRIES) {
+		WARNING("depth is %d instead of %d", test->head.depth,
+			SLIST_TEST_ENTRIES);
+		atomic_inc(&test->errors);
+	}
+	return atomic_read(&test->errors);
+}
+
+/* stress test of PushEntrySList / PopEntrySList on all cpus, with
+ * cmpxchg16b (or cmpxchg8b on i386) and, on x86_64, with spinlock
+ * used by processors without cmpxchg16b */
+static int procfs_read_slist(char *page, char **start, off_t off,
+			     int count, int *eof, void *data)
+{
+	char *p = page;
+	ktime_t t1, t2;
+	int errors;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	mutex_lock(&slist_test_mutex);
+	p += sprintf(p, "cpus=%d\n", num_online_cpus());
+	p += sprintf(p, "rounds=%d\n", SLIST_TEST_ROUNDS);
+	t1 = ktime_get();
+	errors = slist_test_run(&slist_test, 0);
+	t2 = ktime_get();
+#ifdef CONFIG_X86_64
+	p += sprintf(p, "%s_errors=%d\n", boot_cpu_has(X86_FEATURE_CX16) ?
+		     "cmpxchg16b" : "spinlock", errors);
+#else
+	p += sprintf(p, "cmpxchg8b_errors=%d\n", errors);
+#endif
+	p += sprintf(p, "time_us=%lld\n",
+		     (long long)ktime_to_us(ktime_sub(t2, t1)));
+#ifdef CONFIG_X86_64
+	if (boot_cpu_has(X86_FEATURE_CX16)) {
+		t1 = ktime_get();
+		errors = slist_test_run(&slist_test, 1);
+		t2 = ktime_get();
+		p += sprintf(p, "spinlock_errors=%d\n", errors);
+		p += sprintf(p, "spinlock_time_us=%lld\n",
+			     (long long)ktime_to_us(ktime_sub(t2, t1)));
+	}
+#endif
+	mutex_unlock(&slist_test_mutex);
+	return p - page;
+}
+
+/* work items queued to each cpu, how many are waiting and how long
+ * (on average and at most) they waited before running */
+static int procfs_read_work(char *page, char **start, off_t off,
+			    int count, int *eof, void *data)
+{
+	char *p = page;
+	struct ntos_work_queue *queue;
+	int cpu;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(ntos_work_queues, cpu);
+		if (!queue->queued)
+			continue;
+		if (p - page > count - 160)
+			break;
+		p += sprintf(p, "cpu%d: queued=%lu depth=%u max_depth=%lu "
+			     "overflows=%lu latency_us=%lu "
+			     "max_latency_us=%lu\n", cpu, queue->queued,
+			     queue->prod - queue->cons, queue->max_depth,
+			     queue->overflows, queue->runs ?
+			     (unsigned long)div_u64(queue->latency_total,
+						    queue->runs) /
+			     NSEC_PER_USEC : 0UL,
+			     queue->latency_max / NSEC_PER_USEC);
+	}
+	return p - page;
+}
+
+/* how late Windows timers expired */
+static int procfs_read_timers(char *page, char **start, off_t off,
+			      int count, int *eof, void *data)
+{
+	char *p = page;
+	int i;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+#ifdef WRAP_HRTIMER
+	p += sprintf(p, "backend=hrtimer\n");
+#else
+	p += sprintf(p, "backend=jiffies\n");
+#endif
+	p += sprintf(p, "slack_us=%d\n", timer_slack);
+	for (i = 0; i < TIMER_LATE_HIST_SIZE - 1; i++)
+		p += sprintf(p, "late_under_%uus=%lu\n", 1 << i,
+			     timer_late_hist[i]);
+	p += sprintf(p, "late_%uus+=%lu\n", 1 << (i - 1),
+		     timer_late_hist[i]);
+	p += sprintf(p, "late_max_us=%lu\n", timer_late_max);
+	return p - page;
+}
+
+/* pool memory in use and allocated so far, by tag; tags are usually
+ * 4 characters, printed as they are in memory */
+static int procfs_read_pool(char *page, char **start, off_t off,
+			    int count, int *eof, void *data)
+{
+	char *p = page;
+	struct pool_tag_stats *stats;
+	char tag[5];
+	int i, j;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	p += sprintf(p, "max_order=%d\n", pool_max_order);
+	p += sprintf(p, "page_blocks=%ld\n",
+		     atomic_long_read(&pool_page_blocks));
+	p += sprintf(p, "vmalloc_blocks=%ld\n",
+		     atomic_long_read(&pool_vmalloc_blocks));
+	p += sprintf(p, "pow2_blocks=%ld\n",
+		     atomic_long_read(&pool_pow2_blocks));
+	for (i = 0; i < POOL_TAGS; i++) {
+		stats = &pool_tag_stats[i];
+		if (!stats->used)
+			continue;
+		if (p - page > count - 128)
+			break;
+		for (j = 0; j < 4; j++) {
+			tag[j] = ((char *)&stats->tag)[j];
+			if (!isprint(tag[j]))
+				tag[j] = '.';
+		}
+		tag[4] = 0;
+		p += sprintf(p, "%s: allocs=%ld frees=%ld failed=%ld "
+			     "live_bytes=%ld max_live_bytes=%ld\n", tag,
+			     atomic_long_read(&stats->allocs),
+			     atomic_long_read(&stats->frees),
+			     atomic_long_read(&stats->failed),
+			     atomic_long_read(&stats->live_bytes),
+			     atomic_long_read(&stats->max_live_bytes));
+	}
+	return p - page;
+}
+
+/* IRPs allocated from cache for each stack count, and with kmalloc
+ * for bigger stack counts */
+static int procfs_read_irps(char *page, char **start, off_t off,
+			    int count, int *eof, void *data)
+{
+	char *p = page;
+	struct irp_cache *irp_cache;
+	int i;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	for (i = 0; i < IRP_CACHE_STACKS; i++) {
+		irp_cache = &irp_caches[i];
+		p += sprintf(p, "stack_%d: allocs=%ld frees=%ld failed=%ld\n",
+			     i + 1, atomic_long_read(&irp_cache->allocs),
+			     atomic_long_read(&irp_cache->frees),
+			     atomic_long_read(&irp_cache->failed));
+	}
+	p += sprintf(p, "kmalloc_allocs=%ld\n",
+		     atomic_long_read(&irp_kmalloc_allocs));
+	return p - page;
+}
+
+#ifdef WRAP_WQ
+static int procfs_read_workqueues(char *page, char **start, off_t off,
+				  int count, int *eof, void *data)
+{
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+	return wrap_wq_stats(page, count);
+}
+#endif
+
+#ifdef SPINLOCK_STATS
+/* Windows spinlocks that had to be waited for, most recent waiter and
+ * average / maximum hold time in cycles */
+static int procfs_read_spinlocks(char *page, char **start, off_t off,
+				 int count, int *eof, void *data)
+{
+	char *p = page;
+	struct nt_spin_lock_stats *stats;
+	unsigned long tracked, omitted;
+	int i;
+
+	if (off != 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	tracked = omitted = 0;
+	for (i = 0; i < SPIN_LOCK_STATS_SIZE; i++) {
+		stats = &spin_lock_stats[i];
+		if (!stats->lock)
+			continue;
+		tracked++;
+		if (!stats->contended)
+			continue;
+		if (p - page > count - 160) {
+			omitted++;
+			continue;
+		}
+		p += sprintf(p, "%p: acquired=%lu contended=%lu spins=%lu "
+			     "max_spins=%lu hold=%llu max_hold=%llu "
+			     "caller=%p\n", stats->lock, stats->acquired,
+			     stats->contended, stats->spins, stats->max_spins,
+			     stats->acquired ? div_u64(stats->hold_cycles,
+						       stats->acquired) : 0ULL,
+			     (unsigned long long)stats->max_hold_cycles,
+			     stats->caller);
+	}
+	p += sprintf(p, "tracked=%lu omitted=%lu\n", tracked, omitted);
+	return p - page;
+}
+#endif
+
 int wrap_procfs_init(void)
 {
 	struct proc_dir_entry *procfs_entry;
@@ -547,6 +1085,100 @@ int wrap_procfs_init(void)
 		procfs_entry->read_proc = procfs_read_debug;
 		procfs_entry->write_proc = procfs_write_debug;
 	}
+
+	procfs_entry = create_proc_entry("irql", S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'irql'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_irql;
+	}
+
+	procfs_entry = create_proc_entry("slist", S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'slist'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_slist;
+	}
+
+	procfs_entry = create_proc_entry("work", S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'work'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_work;
+	}
+
+	procfs_entry = create_proc_entry("timers",
+					 S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'timers'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_timers;
+	}
+
+	procfs_entry = create_proc_entry("pool", S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'pool'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_pool;
+	}
+
+	procfs_entry = create_proc_entry("irps", S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'irps'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_irps;
+	}
+
+#ifdef WRAP_WQ
+	procfs_entry = create_proc_entry("workqueues",
+					 S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'workqueues'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_workqueues;
+	}
+#endif
+#ifdef SPINLOCK_STATS
+	procfs_entry = create_proc_entry("spinlocks",
+					 S_IFREG | S_IRUSR | S_IRGRP,
+					 wrap_procfs_entry);
+	if (procfs_entry == NULL) {
+		ERROR("couldn't create proc entry for 'spinlocks'");
+		return -ENOMEM;
+	} else {
+		procfs_entry->uid = proc_uid;
+		procfs_entry->gid = proc_gid;
+		procfs_entry->read_proc = procfs_read_spinlocks;
+	}
+#endif
 	return 0;
 }
 
@@ -555,5 +1187,17 @@ void wrap_procfs_remove(void)
 	if (wrap_procfs_entry == NULL)
 		return;
 	remove_proc_entry("debug", wrap_procfs_entry);
+	remove_proc_entry("irql", wrap_procfs_entry);
+	remove_proc_entry("slist", wrap_procfs_entry);
+	remove_proc_entry("irps", wrap_procfs_entry);
+	remove_proc_entry("pool", wrap_procfs_entry);
+	remove_proc_entry("timers", wrap_procfs_entry);
+	remove_proc_entry("work", wrap_procfs_entry);
+#ifdef WRAP_WQ
+	remove_proc_entry("workqueues", wrap_procfs_entry);
+#endif
+#ifdef SPINLOCK_STATS
+	remove_proc_entry("spinlocks", wrap_procfs_entry);
+#endif
 	remove_proc_entry(DRIVER_NAME, proc_net_root);
 }
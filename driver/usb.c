@@ -17,6 +17,7 @@
 #include "ndis.h"
 #include "usb.h"
 #include "usb_exports.h"
+#include "wrapper.h"
 
 #ifdef USB_DEBUG
 static unsigned int urb_id = 0;
@@ -71,8 +72,193 @@ static unsigned int urb_id = 0;
 #endif
 
 /* wrap_urb->flags */
-/* transfer_buffer for urb is allocated; free it in wrap_free_urb */
+/* transfer_buffer for urb is a bounce buffer; return it to pool in
+ * wrap_free_urb */
 #define WRAP_URB_COPY_BUFFER 0x01
+/* urb transfers directly from / to vmalloc'ed pages with scatterlist */
+#define WRAP_URB_SG 0x02
+/* irp's completion routine is known to be safe at DISPATCH_LEVEL, so
+ * it may be completed in complete_tasklet */
+#define WRAP_URB_COMPLETE_INLINE 0x04
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#define WRAP_USB_SG 1
+#endif
+
+/* Buffers that can't be used for DMA (vmalloc'ed or in highmem) are
+ * copied to / from coherent bounce buffers. Bounce buffers are kept
+ * in a pool for each endpoint and direction, sized to the largest
+ * transfer seen on that pipe, and reused. */
+
+/* pools are indexed by endpoint number and direction */
+#define WRAP_BOUNCE_POOLS 32
+/* free bounce buffers kept in a pool */
+#define WRAP_BOUNCE_POOL_MAX 32
+
+struct wrap_bounce_buf {
+	struct nt_slist list;
+	unsigned int size;
+	void *buf;
+	dma_addr_t dma;
+};
+
+struct wrap_bounce_pool {
+	nt_slist_header free;
+	NT_SPIN_LOCK lock;
+	unsigned int buf_size;
+	unsigned long allocs;
+	unsigned long reuses;
+};
+
+static inline struct wrap_bounce_pool *
+wrap_bounce_pool(struct wrap_device *wd, unsigned int pipe)
+{
+	return &wd->usb.bounce_pools[usb_pipeendpoint(pipe) |
+				     (usb_pipein(pipe) ? 0x10 : 0)];
+}
+
+static void wrap_free_bounce(struct wrap_device *wd,
+			     struct wrap_bounce_buf *bounce)
+{
+	usb_free_coherent(wd->usb.udev, bounce->size, bounce->buf,
+			  bounce->dma);
+	kfree(bounce);
+}
+
+static struct wrap_bounce_buf *wrap_get_bounce(struct wrap_device *wd,
+					       unsigned int pipe,
+					       unsigned int len,
+					       gfp_t alloc_flags)
+{
+	struct wrap_bounce_pool *pool = wrap_bounce_pool(wd, pipe);
+	struct wrap_bounce_buf *bounce;
+	struct nt_slist *ent;
+	unsigned int size;
+
+	size = pool->buf_size;
+	if (len > size) {
+		size = roundup_pow_of_two(len);
+		pool->buf_size = size;
+	}
+	while ((ent = PopEntrySList(&pool->free, &pool->lock))) {
+		bounce = container_of(ent, struct wrap_bounce_buf, list);
+		if (bounce->size >= len) {
+			pool->reuses++;
+			return bounce;
+		}
+		/* allocated before a larger transfer was seen */
+		wrap_free_bounce(wd, bounce);
+	}
+	bounce = kmalloc(sizeof(*bounce), alloc_flags);
+	if (!bounce)
+		return NULL;
+	bounce->buf = usb_alloc_coherent(wd->usb.udev, size, alloc_flags,
+					 &bounce->dma);
+	if (!bounce->buf) {
+		kfree(bounce);
+		return NULL;
+	}
+	bounce->size = size;
+	pool->allocs++;
+	USBTRACE("%p, %u, %p", pool, size, bounce->buf);
+	return bounce;
+}
+
+static void wrap_put_bounce(struct wrap_device *wd, unsigned int pipe,
+			    struct wrap_bounce_buf *bounce)
+{
+	struct wrap_bounce_pool *pool = wrap_bounce_pool(wd, pipe);
+
+	if (bounce->size < pool->buf_size ||
+	    pool->free.depth >= WRAP_BOUNCE_POOL_MAX)
+		wrap_free_bounce(wd, bounce);
+	else
+		PushEntrySList(&pool->free, &bounce->list, &pool->lock);
+}
+
+static void wrap_free_bounce_pools(struct wrap_device *wd)
+{
+	struct wrap_bounce_pool *pool;
+	struct nt_slist *ent;
+	int i;
+
+	if (!wd->usb.bounce_pools)
+		return;
+	for (i = 0; i < WRAP_BOUNCE_POOLS; i++) {
+		pool = &wd->usb.bounce_pools[i];
+		while ((ent = PopEntrySList(&pool->free, &pool->lock)))
+			wrap_free_bounce(wd, container_of(ent,
+							  struct wrap_bounce_buf,
+							  list));
+	}
+	kfree(wd->usb.bounce_pools);
+	wd->usb.bounce_pools = NULL;
+}
+
+#ifdef WRAP_USB_SG
+static struct page *wrap_sg_page(void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		return vmalloc_to_page(addr);
+	else if (virt_addr_valid(addr))
+		return virt_to_page(addr);
+	else
+		return NULL;
+}
+
+/* map vmalloc'ed buffer (possibly described by an mdl) with
+ * scatterlist so bulk transfer can be done without copying; pages are
+ * looked up from the buffer itself, as PFN array of an mdl may not
+ * have been built; returns 0 if urb is set up for transfer */
+static int wrap_urb_map_sg(struct wrap_device *wd, struct wrap_urb *wrap_urb,
+			   unsigned int pipe, void *buf, unsigned int len,
+			   gfp_t alloc_flags)
+{
+	struct urb *urb = wrap_urb->urb;
+	unsigned int offset, nents, n, maxp;
+	struct scatterlist *sg;
+	struct page *page;
+	int i;
+
+	if (!usb_pipebulk(pipe) || !is_vmalloc_addr(buf) ||
+	    !wd->usb.udev->bus->sg_tablesize)
+		return -EINVAL;
+	offset = offset_in_page(buf);
+	nents = (offset + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (nents > wd->usb.udev->bus->sg_tablesize)
+		return -EINVAL;
+	/* all but last segment must be multiples of max packet size */
+	maxp = usb_maxpacket(wd->usb.udev, pipe, usb_pipeout(pipe));
+	if (nents > 1 && (!maxp || (PAGE_SIZE - offset) % maxp))
+		return -EINVAL;
+	if (nents > wrap_urb->max_sg_nents) {
+		sg = kmalloc(nents * sizeof(*sg), alloc_flags);
+		if (!sg)
+			return -ENOMEM;
+		kfree(wrap_urb->sg);
+		wrap_urb->sg = sg;
+		wrap_urb->max_sg_nents = nents;
+	}
+	sg = wrap_urb->sg;
+	sg_init_table(sg, nents);
+	for (i = 0; i < nents; i++) {
+		n = min_t(unsigned int, len, PAGE_SIZE - offset);
+		page = wrap_sg_page(buf);
+		if (!page)
+			return -EINVAL;
+		sg_set_page(&sg[i], page, n, offset);
+		buf += n;
+		len -= n;
+		offset = 0;
+	}
+	urb->transfer_buffer = NULL;
+	urb->sg = sg;
+	urb->num_sgs = nents;
+	wrap_urb->flags |= WRAP_URB_SG;
+	wd->usb.sg_urbs++;
+	return 0;
+}
+#endif
 
 static inline int wrap_cancel_urb(struct wrap_urb *wrap_urb)
 {
@@ -92,19 +278,53 @@ static inline int wrap_cancel_urb(struct wrap_urb *wrap_urb)
 
 #define URB_STATUS(wrap_urb) (wrap_urb->urb->status)
 
-static struct nt_list wrap_urb_complete_list;
-static spinlock_t wrap_urb_complete_list_lock;
+/* completed urbs of each device are processed by that device's work
+ * on this workqueue (or its tasklet), so a device with slow
+ * completion routines doesn't hold up other devices */
+static struct workqueue_struct *wrap_usb_wq;
+
+static void wrap_urb_complete_worker(struct work_struct *work);
+#ifndef WRAP_PREEMPT
+static void wrap_urb_complete_tasklet(unsigned long data);
+#endif
 
-static struct work_struct wrap_urb_complete_work;
-static void wrap_urb_complete_worker(struct work_struct *dummy);
+/* completion for urbs killed when device is removed; their irps are
+ * not completed, as the driver is gone */
+static void wrap_urb_killed(struct urb *urb ISR_PT_REGS_PARAM_DECL)
+{
+	USBTRACE("%p", urb);
+}
 
+/* cancel urbs in flight; if 'complete' is set, their irps are
+ * completed (through completion list) as usual */
 static void kill_all_urbs(struct wrap_device *wd, int complete)
+{
+	struct wrap_urb *wrap_urb;
+
+	USBTRACE("%d", wd->usb.num_alloc_urbs);
+	/* urbs are removed from wrap_urb_list only by free_all_urbs,
+	 * so the list can be walked while usb_kill_urb sleeps */
+	nt_list_for_each_entry(wrap_urb, &wd->usb.wrap_urb_list, list) {
+		if (wrap_urb->state != URB_SUBMITTED)
+			continue;
+		WARNING("Windows driver %s didn't free urb: %p",
+			wd->driver->name, wrap_urb->urb);
+		if (!complete)
+			wrap_urb->urb->complete = wrap_urb_killed;
+		usb_kill_urb(wrap_urb->urb);
+	}
+}
+
+/* free all urbs of device; none may be in flight or waiting in
+ * completion list */
+static void free_all_urbs(struct wrap_device *wd)
 {
 	struct nt_list *ent;
 	struct wrap_urb *wrap_urb;
 	KIRQL irql;
 
 	USBTRACE("%d", wd->usb.num_alloc_urbs);
+	memset(&wd->usb.free_urbs, 0, sizeof(wd->usb.free_urbs));
 	while (1) {
 		IoAcquireCancelSpinLock(&irql);
 		ent = RemoveHeadList(&wd->usb.wrap_urb_list);
@@ -112,18 +332,52 @@ static void kill_all_urbs(struct wrap_device *wd, int complete)
 		if (!ent)
 			break;
 		wrap_urb = container_of(ent, struct wrap_urb, list);
-		if (wrap_urb->state == URB_SUBMITTED) {
-			WARNING("Windows driver %s didn't free urb: %p",
-				wd->driver->name, wrap_urb->urb);
-			if (!complete)
-				wrap_urb->urb->complete = NULL;
-			usb_kill_urb(wrap_urb->urb);
-		}
 		USBTRACE("%p, %p", wrap_urb, wrap_urb->urb);
+		if (wrap_urb->bounce)
+			wrap_free_bounce(wd, wrap_urb->bounce);
+		kfree(wrap_urb->sg);
 		usb_free_urb(wrap_urb->urb);
 		kfree(wrap_urb);
 	}
 	wd->usb.num_alloc_urbs = 0;
+	atomic_set(&wd->usb.urbs_in_use, 0);
+}
+
+/* allocate a new wrap_urb and add it to device's list of urbs */
+static struct wrap_urb *wrap_new_urb(struct wrap_device *wd,
+				     gfp_t alloc_flags)
+{
+	struct wrap_urb *wrap_urb;
+	KIRQL irql;
+
+	wrap_urb = kzalloc(sizeof(*wrap_urb), alloc_flags);
+	if (!wrap_urb) {
+		WARNING("couldn't allocate memory");
+		return NULL;
+	}
+	wrap_urb->urb = usb_alloc_urb(0, alloc_flags);
+	if (!wrap_urb->urb) {
+		WARNING("couldn't allocate urb");
+		kfree(wrap_urb);
+		return NULL;
+	}
+	IoAcquireCancelSpinLock(&irql);
+	InsertTailList(&wd->usb.wrap_urb_list, &wrap_urb->list);
+	wd->usb.num_alloc_urbs++;
+	IoReleaseCancelSpinLock(irql);
+	return wrap_urb;
+}
+
+/* return wrap_urb to device's free urbs */
+static void wrap_put_urb(struct wrap_device *wd, struct wrap_urb *wrap_urb)
+{
+	wrap_urb->state = URB_FREE;
+	wrap_urb->flags = 0;
+	wrap_urb->irp = NULL;
+	wrap_urb->bounce = NULL;
+	atomic_dec(&wd->usb.urbs_in_use);
+	PushEntrySList(&wd->usb.free_urbs, &wrap_urb->free_list,
+		       &wd->usb.free_urbs_lock);
 }
 
 /* for a given Linux urb status code, return corresponding NT urb status */
@@ -190,24 +444,12 @@ static void wrap_free_urb(struct urb *urb)
 	irp->cancel_routine = NULL;
 	IRP_WRAP_URB(irp) = NULL;
 	if (wrap_urb->flags & WRAP_URB_COPY_BUFFER) {
-		USBTRACE("freeing DMA buffer for URB: %p %p",
+		USBTRACE("releasing DMA buffer for URB: %p %p",
 			 urb, urb->transfer_buffer);
-		usb_free_coherent(wd->usb.udev, urb->transfer_buffer_length,
-				  urb->transfer_buffer, urb->transfer_dma);
+		wrap_put_bounce(wd, urb->pipe, wrap_urb->bounce);
 	}
 	kfree(urb->setup_packet);
-	if (wd->usb.num_alloc_urbs > MAX_ALLOCATED_URBS) {
-		IoAcquireCancelSpinLock(&irp->cancel_irql);
-		RemoveEntryList(&wrap_urb->list);
-		wd->usb.num_alloc_urbs--;
-		IoReleaseCancelSpinLock(irp->cancel_irql);
-		usb_free_urb(urb);
-		kfree(wrap_urb);
-	} else {
-		wrap_urb->state = URB_FREE;
-		wrap_urb->flags = 0;
-		wrap_urb->irp = NULL;
-	}
+	wrap_put_urb(wd, wrap_urb);
 	return;
 }
 
@@ -243,12 +485,15 @@ wstdcall void wrap_cancel_irp(struct device_object *dev_obj, struct irp *irp)
 WIN_FUNC_DECL(wrap_cancel_irp,2)
 
 static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
-				  void *buf, unsigned int buf_len)
+				  struct mdl *mdl, void *buf,
+				  unsigned int buf_len)
 {
 	struct urb *urb;
 	gfp_t alloc_flags;
 	struct wrap_urb *wrap_urb;
 	struct wrap_device *wd;
+	struct nt_slist *ent;
+	int n;
 
 	USBENTER("irp: %p", irp);
 	wd = IRP_WRAP_DEVICE(irp);
@@ -256,40 +501,30 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 	/* Don't interfere with URB cleanup by the kernel */
 	if (test_bit(HW_DISABLED, &wd->hw_status))
 		return NULL;
+	if (!buf && mdl)
+		buf = MmGetSystemAddressForMdl(mdl);
 
 	alloc_flags = irql_gfp();
-	IoAcquireCancelSpinLock(&irp->cancel_irql);
-	urb = NULL;
-	nt_list_for_each_entry(wrap_urb, &wd->usb.wrap_urb_list, list) {
-		if (cmpxchg(&wrap_urb->state, URB_FREE,
-			    URB_ALLOCATED) == URB_FREE) {
-			urb = wrap_urb->urb;
-			/* Clean URB but keep the refcount */
-			memset((char *)urb + sizeof(urb->kref), 0,
-			       sizeof(*urb) - sizeof(urb->kref));
-			break;
-		}
-	}
-	if (!urb) {
-		IoReleaseCancelSpinLock(irp->cancel_irql);
-		wrap_urb = kzalloc(sizeof(*wrap_urb), alloc_flags);
-		if (!wrap_urb) {
-			WARNING("couldn't allocate memory");
-			return NULL;
-		}
-		urb = usb_alloc_urb(0, alloc_flags);
-		if (!urb) {
-			WARNING("couldn't allocate urb");
-			kfree(wrap_urb);
+	ent = PopEntrySList(&wd->usb.free_urbs, &wd->usb.free_urbs_lock);
+	if (ent) {
+		wrap_urb = container_of(ent, struct wrap_urb, free_list);
+		urb = wrap_urb->urb;
+		/* Clean URB but keep the refcount */
+		memset((char *)urb + sizeof(urb->kref), 0,
+		       sizeof(*urb) - sizeof(urb->kref));
+	} else {
+		wd->usb.urb_alloc_misses++;
+		wrap_urb = wrap_new_urb(wd, alloc_flags);
+		if (!wrap_urb)
 			return NULL;
-		}
-		IoAcquireCancelSpinLock(&irp->cancel_irql);
-		wrap_urb->urb = urb;
-		wrap_urb->state = URB_ALLOCATED;
-		InsertTailList(&wd->usb.wrap_urb_list, &wrap_urb->list);
-		wd->usb.num_alloc_urbs++;
+		urb = wrap_urb->urb;
 	}
+	wrap_urb->state = URB_ALLOCATED;
+	n = atomic_inc_return(&wd->usb.urbs_in_use);
+	if (n > wd->usb.max_urbs_in_use)
+		wd->usb.max_urbs_in_use = n;
 
+	IoAcquireCancelSpinLock(&irp->cancel_irql);
 #ifdef URB_ASYNC_UNLINK
 	urb->transfer_flags |= URB_ASYNC_UNLINK;
 #elif defined(USB_ASYNC_UNLINK)
@@ -309,19 +544,26 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 			       || PageHighMem(virt_to_page(buf))
 #endif
 		    )) {
-		urb->transfer_buffer =
-			usb_alloc_coherent(wd->usb.udev, buf_len, alloc_flags,
-					 &urb->transfer_dma);
-		if (!urb->transfer_buffer) {
+#ifdef WRAP_USB_SG
+		if (wrap_urb_map_sg(wd, wrap_urb, pipe, buf, buf_len,
+				    alloc_flags) == 0) {
+			USBTRACE("sg for urb %p: %d", urb, urb->num_sgs);
+			return urb;
+		}
+#endif
+		wrap_urb->bounce = wrap_get_bounce(wd, pipe, buf_len,
+						   alloc_flags);
+		if (!wrap_urb->bounce) {
 			WARNING("couldn't allocate dma buf");
 			IoAcquireCancelSpinLock(&irp->cancel_irql);
 			irp->cancel_routine = NULL;
-			wrap_urb->state = URB_FREE;
-			wrap_urb->irp = NULL;
 			IRP_WRAP_URB(irp) = NULL;
 			IoReleaseCancelSpinLock(irp->cancel_irql);
+			wrap_put_urb(wd, wrap_urb);
 			return NULL;
 		}
+		urb->transfer_buffer = wrap_urb->bounce->buf;
+		urb->transfer_dma = wrap_urb->bounce->dma;
 		if (urb->transfer_dma)
 			urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 		wrap_urb->flags |= WRAP_URB_COPY_BUFFER;
@@ -373,6 +615,7 @@ static void wrap_urb_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
 {
 	struct irp *irp;
 	struct wrap_urb *wrap_urb;
+	struct wrap_device *wd;
 
 	wrap_urb = urb->context;
 	USBTRACE("%p (%p) completed", wrap_urb, urb);
@@ -387,14 +630,24 @@ static void wrap_urb_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
 	}
 #endif
 	wrap_urb->state = URB_COMPLETED;
-	spin_lock(&wrap_urb_complete_list_lock);
-	InsertTailList(&wrap_urb_complete_list, &wrap_urb->complete_list);
-	spin_unlock(&wrap_urb_complete_list_lock);
-	queue_work(ntos_wq, &wrap_urb_complete_work);
+	wd = IRP_WRAP_DEVICE(irp);
+	spin_lock(&wd->usb.complete_lock);
+	InsertTailList(&wd->usb.complete_list, &wrap_urb->complete_list);
+	spin_unlock(&wd->usb.complete_lock);
+#ifndef WRAP_PREEMPT
+	if (wrap_urb->flags & WRAP_URB_COMPLETE_INLINE) {
+		tasklet_schedule(&wd->usb.complete_tasklet);
+		return;
+	}
+#endif
+	queue_work(wrap_usb_wq, &wd->usb.complete_work);
 }
 
-/* one worker for all devices */
-static void wrap_urb_complete_worker(struct work_struct *dummy)
+/* process completed urbs of a device, in the order they completed;
+ * in complete_tasklet ('in_tasklet' set), processing stops at the
+ * first urb not marked WRAP_URB_COMPLETE_INLINE, which is left, with
+ * those after it, to complete_work */
+static void wrap_urb_complete_all(struct wrap_device *wd, int in_tasklet)
 {
 	struct irp *irp;
 	struct urb *urb;
@@ -403,15 +656,41 @@ static void wrap_urb_complete_worker(struct work_struct *dummy)
 	union nt_urb *nt_urb;
 	struct wrap_urb *wrap_urb;
 	struct nt_list *ent;
-	unsigned long flags;
-
-	USBENTER("");
+	unsigned long flags, n;
+
+	USBENTER("%p", wd);
+	/* work may run on more than one thread at the same time;
+	 * only one of them processes urbs, so they are completed in
+	 * order */
+	if (test_and_set_bit(0, &wd->usb.completing))
+		USBEXIT(return);
+	n = 0;
 	while (1) {
-		spin_lock_irqsave(&wrap_urb_complete_list_lock, flags);
-		ent = RemoveHeadList(&wrap_urb_complete_list);
-		spin_unlock_irqrestore(&wrap_urb_complete_list_lock, flags);
-		if (!ent)
+		spin_lock_irqsave(&wd->usb.complete_lock, flags);
+		ent = RemoveHeadList(&wd->usb.complete_list);
+		if (ent && in_tasklet &&
+		    !(container_of(ent, struct wrap_urb,
+				   complete_list)->flags &
+		      WRAP_URB_COMPLETE_INLINE)) {
+			InsertHeadList(&wd->usb.complete_list, ent);
+			spin_unlock_irqrestore(&wd->usb.complete_lock, flags);
+			clear_bit(0, &wd->usb.completing);
+			/* complete_work queued for this urb may have
+			 * found 'completing' set */
+			queue_work(wrap_usb_wq, &wd->usb.complete_work);
 			break;
+		}
+		spin_unlock_irqrestore(&wd->usb.complete_lock, flags);
+		if (!ent) {
+			clear_bit(0, &wd->usb.completing);
+			smp_mb__after_clear_bit();
+			/* urbs completed after list was found empty */
+			if (IsListEmpty(&wd->usb.complete_list) ||
+			    test_and_set_bit(0, &wd->usb.completing))
+				break;
+			continue;
+		}
+		n++;
 		wrap_urb = container_of(ent, struct wrap_urb, complete_list);
 		urb = wrap_urb->urb;
 #ifdef USB_DEBUG
@@ -437,7 +716,10 @@ static void wrap_urb_complete_worker(struct work_struct *dummy)
 				DUMP_URB_BUFFER(urb, USB_DIR_IN);
 				if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
 				    usb_pipein(urb->pipe))
-					memcpy(bulk_int_tx->transfer_buffer,
+					memcpy(bulk_int_tx->transfer_buffer ?
+					       bulk_int_tx->transfer_buffer :
+					       MmGetSystemAddressForMdl(
+						       bulk_int_tx->mdl),
 					       urb->transfer_buffer,
 					       urb->actual_length);
 			} else { // vendor or class request
@@ -474,9 +756,38 @@ static void wrap_urb_complete_worker(struct work_struct *dummy)
 		wrap_free_urb(urb);
 		IoCompleteRequest(irp, IO_NO_INCREMENT);
 	}
+	wd->usb.urbs_completed += n;
+	if (in_tasklet)
+		wd->usb.urbs_completed_inline += n;
+	if (n > wd->usb.max_complete_batch)
+		wd->usb.max_complete_batch = n;
 	USBEXIT(return);
 }
 
+static void wrap_urb_complete_worker(struct work_struct *work)
+{
+	struct wrap_device *wd;
+
+	wd = container_of(work, struct wrap_device, usb.complete_work);
+	wrap_urb_complete_all(wd, 0);
+}
+
+#ifndef WRAP_PREEMPT
+/* with preempt IRQL backend, Windows functions can be called in
+ * softirq context; completion routines of irps marked
+ * WRAP_URB_COMPLETE_INLINE are run at DISPATCH_LEVEL without
+ * switching to worker thread */
+static void wrap_urb_complete_tasklet(unsigned long data)
+{
+	struct wrap_device *wd = (struct wrap_device *)data;
+	KIRQL irql;
+
+	irql = raise_irql(DISPATCH_LEVEL);
+	wrap_urb_complete_all(wd, 1);
+	lower_irql(irql);
+}
+#endif
+
 static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 {
 	struct usb_endpoint_descriptor *pipe_handle;
@@ -512,7 +823,8 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 	}
 
 	DUMP_IRP(irp);
-	urb = wrap_alloc_urb(irp, pipe, bulk_int_tx->transfer_buffer,
+	urb = wrap_alloc_urb(irp, pipe, bulk_int_tx->mdl,
+			     bulk_int_tx->transfer_buffer,
 			     bulk_int_tx->transfer_buffer_length);
 	if (!urb) {
 		ERROR("couldn't allocate urb");
@@ -538,6 +850,14 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 			 "intvl: %d", urb, urb->pipe,
 			 pipe_handle->bEndpointAddress, pipe_handle->bInterval);
 	}
+#ifndef WRAP_PREEMPT
+	/* a driver that submits irp at DISPATCH_LEVEL must expect it
+	 * to be completed at DISPATCH_LEVEL, e.g., by a lower driver
+	 * completing it right away, so its completion routine is safe
+	 * to run in complete_tasklet */
+	if (wd->usb.complete_inline && current_irql() == DISPATCH_LEVEL)
+		IRP_WRAP_URB(irp)->flags |= WRAP_URB_COMPLETE_INLINE;
+#endif
 	status = wrap_submit_urb(irp);
 	USBTRACE("status: %08X", status);
 	USBEXIT(return status);
@@ -605,7 +925,7 @@ static USBD_STATUS wrap_vendor_or_class_req(struct irp *irp)
 		req_type |= USB_DIR_OUT;
 		USBTRACE("pipe: %x, dir out", pipe);
 	}
-	urb = wrap_alloc_urb(irp, pipe, vc_req->transfer_buffer,
+	urb = wrap_alloc_urb(irp, pipe, NULL, vc_req->transfer_buffer,
 			     vc_req->transfer_buffer_length);
 	if (!urb) {
 		ERROR("couldn't allocate urb");
@@ -1468,9 +1788,11 @@ usb_query_interface(struct wrap_device *wd, struct io_stack_location *irp_sl)
 
 int usb_init(void)
 {
-	InitializeListHead(&wrap_urb_complete_list);
-	spin_lock_init(&wrap_urb_complete_list_lock);
-	INIT_WORK(&wrap_urb_complete_work, wrap_urb_complete_worker);
+	wrap_usb_wq = create_workqueue("wrap_usb_wq");
+	if (!wrap_usb_wq) {
+		ERROR("couldn't create workqueue");
+		return -ENOMEM;
+	}
 #ifdef USB_DEBUG
 	urb_id = 0;
 #endif
@@ -1479,18 +1801,106 @@ int usb_init(void)
 
 void usb_exit(void)
 {
+	if (wrap_usb_wq)
+		destroy_workqueue(wrap_usb_wq);
 	USBEXIT(return);
 }
 
+/* urb and bounce buffer usage, shown in procfs */
+int usb_stats(struct wrap_device *wd, char *page, int count)
+{
+	struct wrap_bounce_pool *pool;
+	char *p = page;
+	int i;
+
+	p += sprintf(p, "num_alloc_urbs=%d\n", wd->usb.num_alloc_urbs);
+	p += sprintf(p, "urbs_in_use=%d\n", atomic_read(&wd->usb.urbs_in_use));
+	p += sprintf(p, "max_urbs_in_use=%d\n", wd->usb.max_urbs_in_use);
+	p += sprintf(p, "urb_alloc_misses=%lu\n", wd->usb.urb_alloc_misses);
+	p += sprintf(p, "sg_urbs=%lu\n", wd->usb.sg_urbs);
+	p += sprintf(p, "complete_inline=%d\n", wd->usb.complete_inline);
+	p += sprintf(p, "urbs_completed=%lu\n", wd->usb.urbs_completed);
+	p += sprintf(p, "urbs_completed_inline=%lu\n",
+		     wd->usb.urbs_completed_inline);
+	p += sprintf(p, "max_complete_batch=%lu\n",
+		     wd->usb.max_complete_batch);
+	for (i = 0; wd->usb.bounce_pools && i < WRAP_BOUNCE_POOLS; i++) {
+		pool = &wd->usb.bounce_pools[i];
+		if (!pool->allocs)
+			continue;
+		if (p - page > count - 80)
+			break;
+		p += sprintf(p, "bounce_ep_%02x: size=%u allocs=%lu "
+			     "reuses=%lu free=%u\n",
+			     (i & 0xf) | ((i & 0x10) ? USB_DIR_IN : 0),
+			     pool->buf_size, pool->allocs, pool->reuses,
+			     pool->free.depth);
+	}
+	return p - page;
+}
+
 int usb_init_device(struct wrap_device *wd)
 {
+	struct wrap_urb *wrap_urb;
+	int i;
+
 	InitializeListHead(&wd->usb.wrap_urb_list);
 	wd->usb.num_alloc_urbs = 0;
+	memset(&wd->usb.free_urbs, 0, sizeof(wd->usb.free_urbs));
+	nt_spin_lock_init(&wd->usb.free_urbs_lock);
+	atomic_set(&wd->usb.urbs_in_use, 0);
+	wd->usb.max_urbs_in_use = 0;
+	wd->usb.urb_alloc_misses = 0;
+	wd->usb.sg_urbs = 0;
+	InitializeListHead(&wd->usb.complete_list);
+	spin_lock_init(&wd->usb.complete_lock);
+	wd->usb.completing = 0;
+	INIT_WORK(&wd->usb.complete_work, wrap_urb_complete_worker);
+#ifdef WRAP_PREEMPT
+	if (usb_complete_inline)
+		WARNING("usb_complete_inline needs IRQL_PREEMPT; ignored");
+	wd->usb.complete_inline = 0;
+#else
+	tasklet_init(&wd->usb.complete_tasklet, wrap_urb_complete_tasklet,
+		     (unsigned long)wd);
+	wd->usb.complete_inline = usb_complete_inline;
+#endif
+	wd->usb.urbs_completed = 0;
+	wd->usb.urbs_completed_inline = 0;
+	wd->usb.max_complete_batch = 0;
+	wd->usb.bounce_pools = kzalloc(WRAP_BOUNCE_POOLS *
+				       sizeof(*wd->usb.bounce_pools),
+				       GFP_KERNEL);
+	if (!wd->usb.bounce_pools)
+		USBEXIT(return -ENOMEM);
+	for (i = 0; i < WRAP_BOUNCE_POOLS; i++)
+		nt_spin_lock_init(&wd->usb.bounce_pools[i].lock);
+	/* preallocate as many urbs as earlier devices of this driver
+	 * needed */
+	for (i = 0; wd->driver && i < wd->driver->max_urbs; i++) {
+		wrap_urb = wrap_new_urb(wd, GFP_KERNEL);
+		if (!wrap_urb)
+			break;
+		wrap_urb->state = URB_FREE;
+		PushEntrySList(&wd->usb.free_urbs, &wrap_urb->free_list,
+			       &wd->usb.free_urbs_lock);
+	}
+	USBTRACE("%d", wd->usb.num_alloc_urbs);
 	USBEXIT(return 0);
 }
 
 void usb_exit_device(struct wrap_device *wd)
 {
+	if (wd->driver && wd->usb.max_urbs_in_use > wd->driver->max_urbs)
+		wd->driver->max_urbs = wd->usb.max_urbs_in_use;
+	/* stop urbs in flight first, so none can be added to
+	 * completion list after it has been processed */
 	kill_all_urbs(wd, 0);
+#ifndef WRAP_PREEMPT
+	tasklet_kill(&wd->usb.complete_tasklet);
+#endif
+	flush_workqueue(wrap_usb_wq);
+	free_all_urbs(wd);
+	wrap_free_bounce_pools(wd);
 	USBEXIT(return);
 }
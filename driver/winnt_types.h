@@ -241,6 +241,7 @@ typedef void (*DPC)(struct kdpc *kdpc, void *ctx, void *arg1,
 		    void *arg2) wstdcall;
 struct kdpc {
 	SHORT type;
+	/* if not 0, DPC runs on processor nr_cpu - 1 */
 	UCHAR nr_cpu;
 	UCHAR importance;
 	struct nt_list list;
@@ -250,9 +251,9 @@ struct kdpc {
 	void *arg2;
 	union {
 		NT_SPIN_LOCK *lock;
-		/* 'lock' is not used; 'queued' represents whether
-		 * kdpc is queued or not */
-		int queued;
+		/* 'lock' is not used; 'queue' is the per-cpu queue
+		 * kdpc is queued in, or NULL if it is not queued */
+		void *queue;
 	};
 };
 
@@ -460,6 +461,10 @@ struct nt_thread {
 	struct nt_list irps;
 	NT_SPIN_LOCK lock;
 	KPRIORITY prio;
+	/* chains in hash tables of threads by task and by thread */
+	struct nt_thread *task_hash_next;
+	struct nt_thread *thread_hash_next;
+	struct rcu_head rcu;
 };
 
 #define set_object_type(dh, type)	((dh)->type = (type))
@@ -1003,11 +1008,18 @@ enum urb_state {
 
 struct wrap_urb {
 	struct nt_list list;
+	/* link in free urbs of device */
+	struct nt_slist free_list;
 	enum urb_state state;
 	struct nt_list complete_list;
 	unsigned int flags;
 	struct urb *urb;
 	struct irp *irp;
+	/* bounce buffer used for transfer, if any */
+	struct wrap_bounce_buf *bounce;
+	/* scatterlist for transfers from vmalloc'ed buffers */
+	struct scatterlist *sg;
+	unsigned int max_sg_nents;
 #ifdef USB_DEBUG
 	unsigned int id;
 #endif
@@ -1076,6 +1088,12 @@ struct irp {
 	} tail;
 };
 
+/* irp->alloc_flags */
+#define IRP_QUOTA_CHARGED		0x01
+#define IRP_ALLOCATED_MUST_SUCCEED	0x02
+#define IRP_ALLOCATED_FIXED_SIZE	0x04
+#define IRP_LOOKASIDE_ALLOCATION	0x08
+
 #define IoSizeOfIrp(stack_count)					\
 	((USHORT)(sizeof(struct irp) +					\
 		  ((stack_count) * sizeof(struct io_stack_location))))
@@ -1332,6 +1350,10 @@ struct kinterrupt {
 	KIRQL irql;
 	KIRQL synch_irql;
 	enum kinterrupt_mode mode;
+	/* if set, this DPC is run by irq thread instead of kdpc_wq;
+	 * see queue_interrupt_dpc */
+	struct kdpc *thread_dpc;
+	unsigned long thread_dpc_pending;
 };
 
 struct time_fields {
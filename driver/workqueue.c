@@ -15,6 +15,14 @@
 
 #include "ntoskernel.h"
 
+/* Work is queued to threads of a (multi-thread) workqueue in
+ * round-robin fashion; a thread that has nothing to do steals work
+ * queued to threads that are busy running other work, so a work that
+ * blocks for long doesn't hold up the works queued behind it. Threads
+ * wake up an idle thread when work is queued to a busy thread. At
+ * most max_active threads of a workqueue run works at the same
+ * time. */
+
 struct workqueue_thread {
 	spinlock_t lock;
 	struct task_struct *task;
@@ -25,6 +33,18 @@ struct workqueue_thread {
 	s8 pending;
 	/* list of work_structs pending */
 	struct list_head work_list;
+	/* work being run, if any */
+	struct work_struct *running;
+	/* set while stealing or running stolen work */
+	u8 thief;
+	/* completed when thief is cleared */
+	struct completion *steal_done;
+	unsigned long depth;
+	unsigned long max_depth;
+	unsigned long runs;
+	unsigned long stolen;
+	u64 run_time;
+	unsigned long max_run_time;
 };
 
 struct workq_thread_data {
@@ -35,12 +55,164 @@ struct workq_thread_data {
 struct wrap_workqueue_struct {
 	u8 singlethread;
 	u8 qon;
+	/* set when a thread couldn't run work due to max_active */
+	u8 throttled;
 	int num_cpus;
+	/* protects active and throttled */
+	spinlock_t lock;
+	int active;
+	int max_active;
+	char name[16];
+	struct list_head list;
 	struct workqueue_thread threads[0];
 };
 
+static LIST_HEAD(wrap_wq_list);
+static DEFINE_SPINLOCK(wrap_wq_list_lock);
+
 static void wrap_destroy_wq_on(struct workqueue_struct *workq, int cpu);
 
+/* take first work queued to thread that is not being cancelled;
+ * called with thread's lock held */
+static struct work_struct *workq_dequeue(struct workqueue_thread *thread)
+{
+	struct work_struct *work;
+
+	list_for_each_entry(work, &thread->work_list, list) {
+		/* if work->thread is already cleared, the work is being
+		 * cancelled and wrap_cancel_work removes it */
+		if (xchg(&work->thread, NULL)) {
+			list_del(&work->list);
+			thread->depth--;
+			return work;
+		}
+	}
+	return NULL;
+}
+
+static struct work_struct *workq_steal(struct workqueue_struct *workq,
+				       struct workqueue_thread *thread)
+{
+	struct workqueue_thread *victim;
+	struct work_struct *work;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < workq->num_cpus; i++) {
+		victim = &workq->threads[i];
+		if (victim == thread || !victim->pid || !victim->running ||
+		    list_empty(&victim->work_list))
+			continue;
+		spin_lock_irqsave(&victim->lock, flags);
+		if (victim->running)
+			work = workq_dequeue(victim);
+		else
+			work = NULL;
+		spin_unlock_irqrestore(&victim->lock, flags);
+		if (work) {
+			thread->stolen++;
+			return work;
+		}
+	}
+	return NULL;
+}
+
+/* wake up thread if it has work or if it can steal work */
+static void workq_wake_thread(struct workqueue_thread *thread)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&thread->lock, flags);
+	if (thread->pending == 0) {
+		thread->pending = 1;
+		wake_up_process(thread->task);
+	}
+	spin_unlock_irqrestore(&thread->lock, flags);
+}
+
+static void workq_wake_idle(struct workqueue_struct *workq)
+{
+	struct workqueue_thread *thread;
+	int i;
+
+	for (i = 0; i < workq->num_cpus; i++) {
+		thread = &workq->threads[i];
+		if (thread->pid && !thread->running && thread->pending == 0) {
+			workq_wake_thread(thread);
+			break;
+		}
+	}
+}
+
+/* get a slot to run work; if max_active threads are already running,
+ * workq_release wakes up threads when a slot is freed */
+static int workq_acquire(struct workqueue_struct *workq)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&workq->lock, flags);
+	if (workq->active < workq->max_active) {
+		workq->active++;
+		ret = 1;
+	} else {
+		workq->throttled = 1;
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&workq->lock, flags);
+	return ret;
+}
+
+static void workq_release(struct workqueue_struct *workq)
+{
+	unsigned long flags;
+	u8 throttled;
+	int i;
+
+	spin_lock_irqsave(&workq->lock, flags);
+	workq->active--;
+	throttled = workq->throttled;
+	workq->throttled = 0;
+	spin_unlock_irqrestore(&workq->lock, flags);
+	if (throttled) {
+		for (i = 0; i < workq->num_cpus; i++)
+			if (workq->threads[i].pid)
+				workq_wake_thread(&workq->threads[i]);
+	}
+}
+
+static void workq_end_steal(struct workqueue_thread *thread)
+{
+	struct completion *done;
+	unsigned long flags;
+
+	spin_lock_irqsave(&thread->lock, flags);
+	thread->thief = 0;
+	done = thread->steal_done;
+	thread->steal_done = NULL;
+	spin_unlock_irqrestore(&thread->lock, flags);
+	if (done)
+		complete(done);
+}
+
+static void workq_run(struct workqueue_thread *thread,
+		      struct work_struct *work)
+{
+	unsigned long run_time;
+	ktime_t start;
+
+	DBG_BLOCK(4) {
+		WORKTRACE("%p, %p", work, thread);
+	}
+	start = ktime_get();
+	work->func(work->data);
+	run_time = ktime_to_ns(ktime_sub(ktime_get(), start));
+	thread->runs++;
+	thread->run_time += run_time;
+	if (run_time > thread->max_run_time)
+		thread->max_run_time = run_time;
+}
+
 static int workq_thread(void *data)
 {
 	struct workq_thread_data *thread_data = data;
@@ -71,9 +243,42 @@ static int workq_thread(void *data)
 			continue;
 		}
 		while (1) {
-			struct list_head *entry;
 			unsigned long flags;
 
+			if (!workq_acquire(workq)) {
+				/* clear pending before trying again, so
+				 * wakeup by workq_release isn't lost */
+				spin_lock_irqsave(&thread->lock, flags);
+				if (thread->pending < 0) {
+					spin_unlock_irqrestore(&thread->lock,
+							       flags);
+					goto out;
+				}
+				thread->pending = 0;
+				spin_unlock_irqrestore(&thread->lock, flags);
+				if (!workq_acquire(workq))
+					break;
+			}
+			spin_lock_irqsave(&thread->lock, flags);
+			work = workq_dequeue(thread);
+			thread->running = work;
+			if (!work && !workq->singlethread)
+				thread->thief = 1;
+			spin_unlock_irqrestore(&thread->lock, flags);
+			if (thread->thief) {
+				work = workq_steal(workq, thread);
+				thread->running = work;
+			}
+			if (work) {
+				workq_run(thread, work);
+				thread->running = NULL;
+			}
+			if (thread->thief)
+				workq_end_steal(thread);
+			workq_release(workq);
+			if (work)
+				continue;
+
 			spin_lock_irqsave(&thread->lock, flags);
 			if (list_empty(&thread->work_list)) {
 				struct completion *completion;
@@ -83,25 +288,13 @@ static int workq_thread(void *data)
 					goto out;
 				}
 				thread->pending = 0;
-				completion = thread->completion;
-				thread->completion = NULL;
+				completion = xchg(&thread->completion, NULL);
 				spin_unlock_irqrestore(&thread->lock, flags);
 				if (completion)
 					complete(completion);
 				break;
 			}
-			entry = thread->work_list.next;
-			work = list_entry(entry, struct work_struct, list);
-			if (xchg(&work->thread, NULL))
-				list_del(entry);
-			else
-				work = NULL;
 			spin_unlock_irqrestore(&thread->lock, flags);
-			DBG_BLOCK(4) {
-				WORKTRACE("%p, %p", work, thread);
-			}
-			if (work)
-				work->func(work->data);
 		}
 	}
 
@@ -128,11 +321,16 @@ static int wrap_queue_work_on(struct workqueue_struct *workq,
 	else {
 		work->thread = thread;
 		list_add_tail(&work->list, &thread->work_list);
+		if (++thread->depth > thread->max_depth)
+			thread->max_depth = thread->depth;
 		thread->pending = 1;
 		wake_up_process(thread->task);
 		ret = 1;
 	}
 	spin_unlock_irqrestore(&thread->lock, flags);
+	/* if thread is busy, some other thread can steal the work */
+	if (ret && thread->running && !workq->singlethread)
+		workq_wake_idle(workq);
 	return ret;
 }
 
@@ -161,12 +359,13 @@ void wrap_cancel_work(struct work_struct *work)
 		WORKTRACE("%p", thread);
 		spin_lock_irqsave(&thread->lock, flags);
 		list_del(&work->list);
+		thread->depth--;
 		spin_unlock_irqrestore(&thread->lock, flags);
 	}
 }
 
 struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
-					u8 freeze)
+					u8 freeze, int max_active)
 {
 	struct completion started;
 	struct workqueue_struct *workq;
@@ -184,6 +383,8 @@ struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
 	}
 	WORKTRACE("%p", workq);
 	workq->singlethread = singlethread;
+	spin_lock_init(&workq->lock);
+	strncpy(workq->name, name, sizeof(workq->name) - 1);
 	init_completion(&started);
 	for_each_online_cpu(i) {
 		struct workq_thread_data thread_data;
@@ -219,6 +420,13 @@ struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
 			break;
 	}
 	workq->num_cpus++;
+	if (max_active > 0)
+		workq->max_active = max_active;
+	else
+		workq->max_active = workq->num_cpus;
+	spin_lock(&wrap_wq_list_lock);
+	list_add_tail(&workq->list, &wrap_wq_list);
+	spin_unlock(&wrap_wq_list_lock);
 	return workq;
 }
 
@@ -247,6 +455,23 @@ void wrap_flush_wq(struct workqueue_struct *workq)
 		n = num_online_cpus();
 	for (i = 0; i < n; i++)
 		wrap_flush_wq_on(workq, i);
+	/* works queued before now may have been stolen and still be
+	 * running */
+	for (i = 0; i < n; i++) {
+		struct workqueue_thread *thread = &workq->threads[i];
+		struct completion done;
+		unsigned long flags;
+		int thief;
+
+		init_completion(&done);
+		spin_lock_irqsave(&thread->lock, flags);
+		thief = thread->thief;
+		if (thief)
+			thread->steal_done = &done;
+		spin_unlock_irqrestore(&thread->lock, flags);
+		if (thief)
+			wait_for_completion(&done);
+	}
 }
 
 static void wrap_destroy_wq_on(struct workqueue_struct *workq, int cpu)
@@ -269,6 +494,9 @@ void wrap_destroy_wq(struct workqueue_struct *workq)
 	int i, n;
 
 	WORKTRACE("%p", workq);
+	spin_lock(&wrap_wq_list_lock);
+	list_del(&workq->list);
+	spin_unlock(&wrap_wq_list_lock);
 	if (workq->singlethread)
 		n = 1;
 	else
@@ -277,3 +505,37 @@ void wrap_destroy_wq(struct workqueue_struct *workq)
 		wrap_destroy_wq_on(workq, i);
 	kfree(workq);
 }
+
+/* per-thread queue depth, works run (and stolen from other threads)
+ * and time spent running them */
+int wrap_wq_stats(char *page, int count)
+{
+	struct workqueue_struct *workq;
+	struct workqueue_thread *thread;
+	char *p = page;
+	int i;
+
+	spin_lock(&wrap_wq_list_lock);
+	list_for_each_entry(workq, &wrap_wq_list, list) {
+		if (p - page > count - 80)
+			break;
+		p += sprintf(p, "%s: active=%d max_active=%d\n", workq->name,
+			     workq->active, workq->max_active);
+		for (i = 0; i < workq->num_cpus; i++) {
+			thread = &workq->threads[i];
+			if (!thread->pid)
+				continue;
+			if (p - page > count - 160)
+				break;
+			p += sprintf(p, "  %d: depth=%lu max_depth=%lu "
+				     "runs=%lu stolen=%lu run_time_us=%llu "
+				     "max_run_time_us=%lu\n", i,
+				     thread->depth, thread->max_depth,
+				     thread->runs, thread->stolen,
+				     div_u64(thread->run_time, NSEC_PER_USEC),
+				     thread->max_run_time / NSEC_PER_USEC);
+		}
+	}
+	spin_unlock(&wrap_wq_list_lock);
+	return p - page;
+}
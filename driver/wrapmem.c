@@ -270,14 +270,18 @@ void wrap_free_pages(unsigned long ptr, int order)
 void *wrap_ExAllocatePoolWithTag(enum pool_type pool_type, SIZE_T size,
 				 ULONG tag, const char *file, int line)
 {
-	void *addr;
+	void *addr, *base;
 	struct alloc_info *info;
 
 	ENTER4("pool_type: %d, size: %zu, tag: %u", pool_type, size, tag);
 	addr = (ExAllocatePoolWithTag)(pool_type, size, tag);
 	if (!addr)
 		return NULL;
-	info = addr - sizeof(*info);
+	/* blocks from pool's kmem_caches are not tracked here */
+	base = pool_block_base(addr);
+	if (!base)
+		EXIT4(return addr);
+	info = base - sizeof(*info);
 	info->file = file;
 	info->line = line;
 	info->tag = tag;
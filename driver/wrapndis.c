@@ -17,6 +17,7 @@
 #include <linux/ip.h>
 #include <linux/in.h>
 #include <linux/proc_fs.h>
+#include <linux/log2.h>
 #include "ndis.h"
 #include "iw_ndis.h"
 #include "pnp.h"
@@ -31,6 +32,9 @@ wstdcall NTSTATUS NdisDispatchPnp(struct device_object *fdo, struct irp *irp);
 wstdcall NTSTATUS NdisDispatchPower(struct device_object *fdo, struct irp *irp);
 
 struct workqueue_struct *wrapndis_wq;
+/* tx_work runs in its own queue, so it is not held up by ndis_work
+ * blocking in driver's query / set */
+struct workqueue_struct *wrapndis_tx_wq;
 
 static int set_packet_filter(struct ndis_device *wnd,
 			     ULONG packet_filter);
@@ -204,6 +208,15 @@ static NDIS_STATUS mp_init(struct ndis_device *wnd)
 		EXIT1(return NDIS_STATUS_NOT_RECOGNIZED);
 	}
 	mp = &wnd->wd->driver->ndis_driver->mp;
+	/* timers are initialized by driver's init */
+	wnd->timer_slack = ndis_get_setting_int(wnd, "timer_slack",
+						timer_slack);
+#ifndef WRAP_PREEMPT
+	if (wrap_is_usb_bus(wnd->wd->dev_bus))
+		wnd->wd->usb.complete_inline =
+			ndis_get_setting_int(wnd, "usb_complete_inline",
+					     usb_complete_inline);
+#endif
 	status = LIN2WIN6(mp->init, &error_status, &medium_index, medium_array,
 			  ARRAY_SIZE(medium_array), wnd->nmb, wnd->nmb);
 	TRACE1("init returns: %08X, irql: %d", status, current_irql());
@@ -289,7 +302,7 @@ static void mp_halt(struct ndis_device *wnd)
 		/* ktimer that this wrap_timer is associated to can't
 		 * be touched, as it may have been freed by the driver
 		 * already */
-		if (del_timer_sync(&wrap_timer->timer))
+		if (wrap_del_timer_sync(wrap_timer))
 			WARNING("Buggy Windows driver left timer %p "
 				"running", wrap_timer->nt_timer);
 		memset(wrap_timer, 0, sizeof(*wrap_timer));
@@ -545,6 +558,41 @@ static struct ndis_packet *alloc_tx_packet(struct ndis_device *wnd,
 	return packet;
 }
 
+/* how long to wait for the driver to complete a packet after it ran
+ * out of resources before trying to send again */
+#define TX_RETRY_DELAY MSEC_TO_HZ(10)
+
+/* append list of packets, linked through tx_next, from head to tail,
+ * to tx_resend list */
+static void tx_resend_add(struct ndis_device *wnd, struct ndis_packet *head,
+			  struct ndis_packet *tail)
+{
+	unsigned long flags;
+
+	NDIS_PACKET_OOB_DATA(tail)->tx_next = NULL;
+	spin_lock_irqsave(&wnd->tx_resend_lock, flags);
+	if (wnd->tx_resend_tail)
+		NDIS_PACKET_OOB_DATA(wnd->tx_resend_tail)->tx_next = head;
+	else
+		wnd->tx_resend_head = head;
+	wnd->tx_resend_tail = tail;
+	spin_unlock_irqrestore(&wnd->tx_resend_lock, flags);
+}
+
+/* detach tx_resend list; returns its first packet */
+static struct ndis_packet *tx_resend_take(struct ndis_device *wnd)
+{
+	struct ndis_packet *head;
+	unsigned long flags;
+
+	spin_lock_irqsave(&wnd->tx_resend_lock, flags);
+	head = wnd->tx_resend_head;
+	wnd->tx_resend_head = NULL;
+	wnd->tx_resend_tail = NULL;
+	spin_unlock_irqrestore(&wnd->tx_resend_lock, flags);
+	return head;
+}
+
 void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 		    NDIS_STATUS status)
 {
@@ -559,6 +607,26 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 	skb = oob_data->tx_skb;
 	buffer = packet->private.buffer_head;
 	TRACE4("%p, %p, %p, %08X", packet, buffer, skb, status);
+	if (wnd->tx_direct) {
+		if (status == NDIS_STATUS_RESOURCES) {
+			/* driver is out of resources; tx_worker
+			 * resends packet, ahead of tx_ring, when they
+			 * become available or after TX_RETRY_DELAY */
+			wnd->tx_ok = 0;
+			wnd->tx_direct_stalled = 1;
+			tx_resend_add(wnd, packet, packet);
+			atomic_inc_var(wnd->tx_direct_requeued);
+			mod_timer(&wnd->tx_retry_timer,
+				  jiffies + TX_RETRY_DELAY);
+			EXIT4(return);
+		} else if (status == NDIS_STATUS_SUCCESS &&
+			   xchg(&wnd->tx_direct_stalled, 0)) {
+			/* as with serialized drivers, resume after
+			 * driver completes a packet */
+			wnd->tx_ok = 1;
+			queue_work(wrapndis_tx_wq, &wnd->tx_work);
+		}
+	}
 	if (status == NDIS_STATUS_SUCCESS) {
 		pre_atomic_add(wnd->net_stats.tx_bytes, packet->private.len);
 		atomic_inc_var(wnd->net_stats.tx_packets);
@@ -572,9 +640,11 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 	dev_kfree_skb_any(skb);
 	pool = packet->private.pool;
 	NdisFreePacket(packet);
+	/* queue may have been stopped because packet pool was
+	 * exhausted, with the ring itself (nearly) empty */
 	if (netif_queue_stopped(wnd->net_dev) &&
-	    ((pool->max_descr - pool->num_used_descr) >=
-	     (wnd->max_tx_packets / 4))) {
+	    tx_ring_free(wnd) >= wnd->tx_ring_wake &&
+	    NdisPacketPoolUsage(pool) < pool->max_descr) {
 		set_bit(NETIF_WAKEQ, &wnd->ndis_pending_work);
 		queue_work(wrapndis_wq, &wnd->ndis_work);
 	}
@@ -582,32 +652,32 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 }
 
 /* MiniportSend and MiniportSendPackets */
-/* this function is called holding tx_ring_mutex. start and n are such
- * that start + n < TX_RING_SIZE; i.e., packets don't wrap around
- * ring */
-static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
+/* this function is called holding tx_ring_mutex; 'packets' is an
+ * array of n packets */
+static unsigned int mp_tx_packets(struct ndis_device *wnd,
+				  struct ndis_packet **packets, unsigned int n)
 {
 	NDIS_STATUS res;
 	struct miniport *mp;
 	struct ndis_packet *packet;
-	u8 sent;
+	unsigned int sent;
 	KIRQL irql;
 
-	ENTER3("%d, %d", start, n);
+	ENTER3("%p, %d", packets, n);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	if (mp->send_packets) {
 		if (deserialized_driver(wnd)) {
 			LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx,
-				 &wnd->tx_ring[start], n);
+				 packets, n);
 			sent = n;
 		} else {
 			irql = serialize_lock_irql(wnd);
 			LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx,
-				 &wnd->tx_ring[start], n);
+				 packets, n);
 			serialize_unlock_irql(wnd, irql);
 			for (sent = 0; sent < n && wnd->tx_ok; sent++) {
 				struct ndis_packet_oob_data *oob_data;
-				packet = wnd->tx_ring[start + sent];
+				packet = packets[sent];
 				oob_data = NDIS_PACKET_OOB_DATA(packet);
 				switch ((res =
 					 xchg(&oob_data->status,
@@ -643,7 +713,7 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 	} else {
 		for (sent = 0; sent < n && wnd->tx_ok; sent++) {
 			struct ndis_packet_oob_data *oob_data;
-			packet = wnd->tx_ring[start + sent];
+			packet = packets[sent];
 			oob_data = NDIS_PACKET_OOB_DATA(packet);
 			oob_data->status = NDIS_STATUS_NOT_RECOGNIZED;
 			irql = serialize_lock_irql(wnd);
@@ -675,46 +745,204 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 	EXIT3(return sent);
 }
 
+/* copy up to max published packets starting at tx_ring_cons into
+ * tx_array, across the end of the ring; called holding
+ * tx_ring_mutex */
+static unsigned int tx_ring_gather(struct ndis_device *wnd, unsigned int max)
+{
+	struct ndis_packet *packet;
+	unsigned int cons, n;
+
+	cons = wnd->tx_ring_cons;
+	for (n = 0; n < max; n++) {
+		packet = ACCESS_ONCE(wnd->tx_ring[(cons + n) &
+						  wnd->tx_ring_mask]);
+		if (!packet)
+			break;
+		wnd->tx_array[n] = packet;
+	}
+	/* read packets only after they are seen published */
+	smp_rmb();
+	return n;
+}
+
+/* release n slots at tx_ring_cons; called holding tx_ring_mutex */
+static void tx_ring_consume(struct ndis_device *wnd, unsigned int n)
+{
+	unsigned int cons, i;
+
+	cons = wnd->tx_ring_cons;
+	for (i = 0; i < n; i++)
+		wnd->tx_ring[(cons + i) & wnd->tx_ring_mask] = NULL;
+	/* producers must see cleared slots before new consumer index */
+	smp_wmb();
+	ACCESS_ONCE(wnd->tx_ring_cons) = cons + n;
+}
+
+static void tx_batch_stats(struct ndis_device *wnd, unsigned int n)
+{
+	int i = fls(n) - 1;
+
+	if (i >= TX_BATCH_HIST_SIZE)
+		i = TX_BATCH_HIST_SIZE - 1;
+	wnd->tx_batch_hist[i]++;
+	wnd->tx_batch_packets += n;
+}
+
+/* resends packets in tx_resend list, in order, until driver runs out
+ * of resources again; packets not sent are put back in the list
+ * after those the driver has just given back. Called holding
+ * tx_ring_mutex */
+static void tx_resend(struct ndis_device *wnd)
+{
+	struct ndis_packet *packet, *tail;
+	unsigned int n, sent;
+
+	packet = tx_resend_take(wnd);
+	while (packet && wnd->tx_ok) {
+		for (n = 0; packet && n < wnd->max_tx_packets; n++) {
+			wnd->tx_array[n] = packet;
+			packet = NDIS_PACKET_OOB_DATA(packet)->tx_next;
+		}
+		tx_batch_stats(wnd, n);
+		sent = mp_tx_packets(wnd, wnd->tx_array, n);
+		if (sent)
+			wnd->net_dev->trans_start = jiffies;
+		if (sent < n) {
+			/* packets not passed to driver are still
+			 * linked to the rest */
+			packet = wnd->tx_array[sent];
+			break;
+		}
+	}
+	if (packet) {
+		for (tail = packet; NDIS_PACKET_OOB_DATA(tail)->tx_next;
+		     tail = NDIS_PACKET_OOB_DATA(tail)->tx_next)
+			;
+		tx_resend_add(wnd, packet, tail);
+	}
+}
+
+/* resumes sending after driver ran out of resources, if it hasn't
+ * completed a packet since */
+static void tx_retry_proc(unsigned long data)
+{
+	struct ndis_device *wnd = (struct ndis_device *)data;
+
+	TRACE3("%d", wnd->tx_direct_stalled);
+	if (wnd->tx_direct && netif_carrier_ok(wnd->net_dev) &&
+	    xchg(&wnd->tx_direct_stalled, 0)) {
+		wnd->tx_ok = 1;
+		queue_work(wrapndis_tx_wq, &wnd->tx_work);
+	}
+}
+
+/* throws away packets in tx_resend list; called when device is
+ * removed, after tx_direct is cleared */
+static void tx_resend_purge(struct ndis_device *wnd)
+{
+	struct ndis_packet *packet, *next;
+
+	del_timer_sync(&wnd->tx_retry_timer);
+	packet = tx_resend_take(wnd);
+	while (packet) {
+		next = NDIS_PACKET_OOB_DATA(packet)->tx_next;
+		free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
+		packet = next;
+	}
+}
+
+/* drains tx_ring in batches of up to max_tx_packets, holding
+ * tx_ring_mutex across batches; packets the driver gave back for
+ * lack of resources are resent first. After tx_ring_size packets,
+ * the work is requeued so others waiting for the mutex get a
+ * chance */
 static void tx_worker(struct work_struct *work)
 {
 	struct ndis_device *wnd;
-	s8 n;
+	unsigned int n, budget;
 
 	wnd = container_of(work, struct ndis_device, tx_work);
 	ENTER3("tx_ok %d", wnd->tx_ok);
+	if (!wnd->tx_ok)
+		EXIT3(return);
+	mutex_lock(&wnd->tx_ring_mutex);
+	budget = wnd->tx_ring_size;
 	while (wnd->tx_ok) {
-		mutex_lock(&wnd->tx_ring_mutex);
-		spin_lock_bh(&wnd->tx_ring_lock);
-		n = wnd->tx_ring_end - wnd->tx_ring_start;
-		TRACE3("%d, %d, %d", wnd->tx_ring_start, wnd->tx_ring_end, n);
-		/* end == start if either ring is empty or full; in
-		 * the latter case is_tx_ring_full is set */
-		if (n == 0) {
-			if (wnd->is_tx_ring_full)
-				n = TX_RING_SIZE - wnd->tx_ring_start;
-			else {
-				spin_unlock_bh(&wnd->tx_ring_lock);
-				mutex_unlock(&wnd->tx_ring_mutex);
+		if (ACCESS_ONCE(wnd->tx_resend_head)) {
+			tx_resend(wnd);
+			if (!wnd->tx_ok)
 				break;
-			}
-		} else if (n < 0)
-			n = TX_RING_SIZE - wnd->tx_ring_start;
-		spin_unlock_bh(&wnd->tx_ring_lock);
-		if (unlikely(n > wnd->max_tx_packets))
-			n = wnd->max_tx_packets;
-		n = mp_tx_packets(wnd, wnd->tx_ring_start, n);
+		}
+		n = tx_ring_gather(wnd, wnd->max_tx_packets);
+		TRACE3("%u, %u, %u", wnd->tx_ring_cons, wnd->tx_ring_prod, n);
+		if (n == 0)
+			break;
+		tx_batch_stats(wnd, n);
+		n = mp_tx_packets(wnd, wnd->tx_array, n);
 		if (n) {
 			wnd->net_dev->trans_start = jiffies;
-			wnd->tx_ring_start =
-				(wnd->tx_ring_start + n) % TX_RING_SIZE;
-			wnd->is_tx_ring_full = 0;
+			tx_ring_consume(wnd, n);
 		}
-		mutex_unlock(&wnd->tx_ring_mutex);
-		TRACE3("%d, %d, %d", wnd->tx_ring_start, wnd->tx_ring_end, n);
+		if (netif_queue_stopped(wnd->net_dev) &&
+		    tx_ring_free(wnd) >= wnd->tx_ring_wake) {
+			local_bh_disable();
+			netif_wake_queue(wnd->net_dev);
+			local_bh_enable();
+		}
+		if (n >= budget) {
+			queue_work(wrapndis_tx_wq, &wnd->tx_work);
+			break;
+		}
+		budget -= n;
 	}
+	mutex_unlock(&wnd->tx_ring_mutex);
 	EXIT3(return);
 }
 
+/* claim a slot in tx_ring and publish packet in it; returns -EBUSY
+ * if ring is full. Any number of producers may run concurrently */
+static int tx_ring_enqueue(struct ndis_device *wnd, struct ndis_packet *packet)
+{
+	unsigned int prod, cons;
+
+	do {
+		prod = ACCESS_ONCE(wnd->tx_ring_prod);
+		cons = ACCESS_ONCE(wnd->tx_ring_cons);
+		if (unlikely(prod - cons >= wnd->tx_ring_size))
+			return -EBUSY;
+	} while (cmpxchg(&wnd->tx_ring_prod, prod, prod + 1) != prod);
+	/* consumer clears the slot before advancing tx_ring_cons, so
+	 * the slot is free; packet must be complete before it is
+	 * published */
+	smp_wmb();
+	ACCESS_ONCE(wnd->tx_ring[prod & wnd->tx_ring_mask]) = packet;
+	return 0;
+}
+
+#ifndef WRAP_PREEMPT
+/* deserialized drivers take packets at DISPATCH_LEVEL, so when
+ * nothing is waiting in tx_ring, the packet is passed to the driver
+ * here instead of in tx_worker. If the driver completes it with
+ * NDIS_STATUS_RESOURCES, free_tx_packet queues it for tx_worker to
+ * resend */
+static int tx_direct_xmit(struct ndis_device *wnd, struct ndis_packet *packet)
+{
+	struct miniport *mp;
+	KIRQL irql;
+
+	if (!wnd->tx_ok || tx_ring_used(wnd) ||
+	    ACCESS_ONCE(wnd->tx_resend_head))
+		return -EBUSY;
+	mp = &wnd->wd->driver->ndis_driver->mp;
+	irql = raise_irql(DISPATCH_LEVEL);
+	LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx, &packet, 1);
+	lower_irql(irql);
+	atomic_inc_var(wnd->tx_direct_packets);
+	return 0;
+}
+#endif
+
 static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
@@ -723,24 +951,39 @@ static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 	packet = alloc_tx_packet(wnd, skb);
 	if (!packet) {
 		TRACE2("couldn't allocate packet");
-		netif_tx_lock(dev);
 		netif_stop_queue(dev);
-		netif_tx_unlock(dev);
 		return NETDEV_TX_BUSY;
 	}
-	spin_lock(&wnd->tx_ring_lock);
-	wnd->tx_ring[wnd->tx_ring_end++] = packet;
-	if (wnd->tx_ring_end == TX_RING_SIZE)
-		wnd->tx_ring_end = 0;
-	if (wnd->tx_ring_end == wnd->tx_ring_start) {
-		netif_tx_lock(dev);
-		wnd->is_tx_ring_full = 1;
+#ifndef WRAP_PREEMPT
+	if (wnd->tx_direct && tx_direct_xmit(wnd, packet) == 0) {
+		dev->trans_start = jiffies;
+		return NETDEV_TX_OK;
+	}
+#endif
+	if (unlikely(tx_ring_enqueue(wnd, packet))) {
+		/* another producer filled the ring before queue was
+		 * stopped; give the packet back, but keep skb */
+		struct ndis_packet_oob_data *oob_data;
+
+		oob_data = NDIS_PACKET_OOB_DATA(packet);
+		if (wnd->sg_dma_size)
+			free_tx_sg_list(wnd, oob_data);
+		NdisFreeBuffer(packet->private.buffer_head);
+		NdisFreePacket(packet);
 		netif_stop_queue(dev);
-		netif_tx_unlock(dev);
+		queue_work(wrapndis_tx_wq, &wnd->tx_work);
+		return NETDEV_TX_BUSY;
 	}
-	spin_unlock(&wnd->tx_ring_lock);
-	TRACE4("ring: %d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
-	queue_work(wrapndis_wq, &wnd->tx_work);
+	if (unlikely(tx_ring_free(wnd) < wnd->tx_ring_stop)) {
+		netif_stop_queue(dev);
+		/* tx_worker may have drained the ring before it could
+		 * see the queue stopped */
+		smp_mb();
+		if (tx_ring_free(wnd) >= wnd->tx_ring_wake)
+			netif_wake_queue(dev);
+	}
+	TRACE4("ring: %u, %u", wnd->tx_ring_cons, wnd->tx_ring_prod);
+	queue_work(wrapndis_tx_wq, &wnd->tx_work);
 	return NETDEV_TX_OK;
 }
 
@@ -846,6 +1089,45 @@ static void ndis_net_dev_uninit(struct net_device *net_dev)
 	EXIT1(return);
 }
 
+#ifdef WRAP_NAPI
+static int ndis_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct ndis_device *wnd = container_of(napi, struct ndis_device, napi);
+	struct sk_buff *skb;
+	int n;
+
+	n = 0;
+	while (n < budget) {
+		if (skb_queue_empty(&wnd->rx_poll_queue)) {
+			/* take all queued skbs at once */
+			spin_lock_irq(&wnd->rx_queue.lock);
+			skb_queue_splice_tail_init(&wnd->rx_queue,
+						   &wnd->rx_poll_queue);
+			spin_unlock_irq(&wnd->rx_queue.lock);
+			if (skb_queue_empty(&wnd->rx_poll_queue))
+				break;
+		}
+		skb = __skb_dequeue(&wnd->rx_poll_queue);
+		napi_gro_receive(napi, skb);
+		n++;
+	}
+	if (n < budget) {
+		napi_complete(napi);
+		/* skbs queued after rx_queue was found empty but
+		 * before napi_complete wouldn't cause a poll */
+		if (!skb_queue_empty(&wnd->rx_queue))
+			napi_schedule(napi);
+	}
+	return n;
+}
+
+static void rx_queue_purge(struct ndis_device *wnd)
+{
+	skb_queue_purge(&wnd->rx_queue);
+	__skb_queue_purge(&wnd->rx_poll_queue);
+}
+#endif
+
 static int ndis_net_dev_open(struct net_device *net_dev)
 {
 	int status, res;
@@ -858,14 +1140,23 @@ static int ndis_net_dev_open(struct net_device *net_dev)
 		set_media_state(wnd, status);
 	netif_start_queue(net_dev);
 	netif_poll_enable(net_dev);
+#ifdef WRAP_NAPI
+	napi_enable(&wnd->napi);
+#endif
 	EXIT1(return 0);
 }
 
 static int ndis_net_dev_close(struct net_device *net_dev)
 {
-	ENTER1("%p", netdev_priv(net_dev));
+	struct ndis_device *wnd = netdev_priv(net_dev);
+
+	ENTER1("%p", wnd);
 	netif_poll_disable(net_dev);
 	netif_tx_disable(net_dev);
+#ifdef WRAP_NAPI
+	napi_disable(&wnd->napi);
+	rx_queue_purge(wnd);
+#endif
 	EXIT1(return 0);
 }
 
@@ -1804,6 +2095,49 @@ static const struct net_device_ops ndis_netdev_ops = {
 };
 #endif
 
+static int init_tx_ring(struct ndis_device *wnd)
+{
+	int size;
+
+	size = ndis_get_setting_int(wnd, "tx_ring_size", tx_ring_size);
+	if (size < MIN_TX_RING_SIZE)
+		size = MIN_TX_RING_SIZE;
+	else if (size > MAX_TX_RING_SIZE)
+		size = MAX_TX_RING_SIZE;
+	size = roundup_pow_of_two(size);
+	wnd->tx_ring = kcalloc(size, sizeof(*wnd->tx_ring), GFP_KERNEL);
+	if (!wnd->tx_ring)
+		return -ENOMEM;
+	wnd->tx_ring_size = size;
+	wnd->tx_ring_mask = size - 1;
+	wnd->tx_ring_prod = 0;
+	wnd->tx_ring_cons = 0;
+	/* with LLTX, more than one producer may pass the check for
+	 * free slots at the same time, so stop early */
+	wnd->tx_ring_stop = max_t(unsigned int, size / 8,
+				  min_t(unsigned int, num_possible_cpus(),
+					size / 4));
+	wnd->tx_ring_wake = size / 2;
+	TRACE1("tx ring: %u, %u, %u", size, wnd->tx_ring_stop,
+	       wnd->tx_ring_wake);
+
+	wnd->tx_direct = 0;
+	if (ndis_get_setting_int(wnd, "tx_direct", tx_direct)) {
+#ifdef WRAP_PREEMPT
+		WARNING("%s: tx_direct is not supported with WRAP_PREEMPT",
+			wnd->wd->driver->name);
+#else
+		if (deserialized_driver(wnd) &&
+		    wnd->wd->driver->ndis_driver->mp.send_packets)
+			wnd->tx_direct = 1;
+		else
+			WARNING("%s: tx_direct needs deserialized driver",
+				wnd->wd->driver->name);
+#endif
+	}
+	return 0;
+}
+
 static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 {
 	struct wrap_device *wd;
@@ -1889,6 +2223,18 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 	net_dev->features |= NETIF_F_LLTX;
 #endif
 
+	if (init_tx_ring(wnd)) {
+		ERROR("couldn't allocate tx ring");
+		goto err_tx_ring;
+	}
+#ifdef WRAP_NAPI
+	n = ndis_get_setting_int(wnd, "napi_weight", napi_weight);
+	if (n < 1)
+		n = 1;
+	else if (n > MAX_NAPI_WEIGHT)
+		n = MAX_NAPI_WEIGHT;
+	netif_napi_add(net_dev, &wnd->napi, ndis_napi_poll, n);
+#endif
 	if (register_netdev(net_dev)) {
 		ERROR("cannot register net device %s", net_dev->name);
 		goto err_register;
@@ -1912,26 +2258,28 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 
 	if (deserialized_driver(wnd)) {
 		/* deserialized drivers don't have a limit, but we
-		 * keep max at TX_RING_SIZE */
-		wnd->max_tx_packets = TX_RING_SIZE;
+		 * keep max at MAX_TX_PACKETS */
+		wnd->max_tx_packets = MAX_TX_PACKETS;
 	} else {
 		status = mp_query_int(wnd, OID_GEN_MAXIMUM_SEND_PACKETS,
 				      &wnd->max_tx_packets);
 		if (status != NDIS_STATUS_SUCCESS)
 			wnd->max_tx_packets = 1;
-		if (wnd->max_tx_packets > TX_RING_SIZE)
-			wnd->max_tx_packets = TX_RING_SIZE;
+		if (wnd->max_tx_packets > MAX_TX_PACKETS)
+			wnd->max_tx_packets = MAX_TX_PACKETS;
 	}
 	TRACE2("maximum send packets: %d", wnd->max_tx_packets);
+	/* packets are allocated when queued to tx_ring and freed when
+	 * driver completes them */
 	NdisAllocatePacketPoolEx(&status, &wnd->tx_packet_pool,
-				 wnd->max_tx_packets, 0,
+				 wnd->tx_ring_size + wnd->max_tx_packets, 0,
 				 PROTOCOL_RESERVED_SIZE_IN_PACKET);
 	if (status != NDIS_STATUS_SUCCESS) {
 		ERROR("couldn't allocate packet pool");
 		goto packet_pool_err;
 	}
 	NdisAllocateBufferPool(&status, &wnd->tx_buffer_pool,
-			       wnd->max_tx_packets + 4);
+			       wnd->tx_ring_size + wnd->max_tx_packets + 4);
 	if (status != NDIS_STATUS_SUCCESS) {
 		ERROR("couldn't allocate buffer pool");
 		goto buffer_pool_err;
@@ -1999,6 +2347,9 @@ packet_pool_err:
 	unregister_netdev(net_dev);
 	wnd->max_tx_packets = 0;
 err_register:
+	kfree(wnd->tx_ring);
+	wnd->tx_ring = NULL;
+err_tx_ring:
 	kfree(buf);
 err_start:
 	mp_halt(wnd);
@@ -2007,12 +2358,12 @@ err_start:
 
 static int ndis_remove_device(struct ndis_device *wnd)
 {
-	s8 tx_pending;
 	int our_mutex;
 
 	/* prevent setting essid during disassociation */
 	memset(&wnd->essid, 0, sizeof(wnd->essid));
 	wnd->tx_ok = 0;
+	wnd->tx_direct = 0;
 	netif_carrier_off(wnd->net_dev);
 	if (wnd->max_tx_packets)
 		unregister_netdev(wnd->net_dev);
@@ -2021,26 +2372,35 @@ static int ndis_remove_device(struct ndis_device *wnd)
 	our_mutex = mutex_trylock(&wnd->tx_ring_mutex);
 	if (!our_mutex)
 		WARNING("couldn't obtain tx_ring_mutex");
-	spin_lock_bh(&wnd->tx_ring_lock);
-	tx_pending = wnd->tx_ring_end - wnd->tx_ring_start;
-	if (tx_pending < 0)
-		tx_pending += TX_RING_SIZE;
-	else if (tx_pending == 0 && wnd->is_tx_ring_full)
-		tx_pending = TX_RING_SIZE - 1;
-	wnd->is_tx_ring_full = 0;
-	/* throw away pending packets */
-	while (tx_pending-- > 0) {
+	/* net device is unregistered, so there are no producers;
+	 * throw away pending packets */
+	while (wnd->tx_ring && tx_ring_used(wnd) > 0) {
 		struct ndis_packet *packet;
 
-		packet = wnd->tx_ring[wnd->tx_ring_start];
-		free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
-		wnd->tx_ring_start = (wnd->tx_ring_start + 1) % TX_RING_SIZE;
+		packet = wnd->tx_ring[wnd->tx_ring_cons & wnd->tx_ring_mask];
+		if (packet)
+			free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
+		tx_ring_consume(wnd, 1);
 	}
-	spin_unlock_bh(&wnd->tx_ring_lock);
+	tx_resend_purge(wnd);
 	if (our_mutex)
 		mutex_unlock(&wnd->tx_ring_mutex);
+	/* give received packets back to driver before it is halted */
+	flush_workqueue(wrapndis_tx_wq);
+	flush_workqueue(wrapndis_wq);
+	ndis_return_packets(wnd);
 	mp_halt(wnd);
+	/* driver may have indicated packets (or completed sends,
+	 * which queue tx_work) until it was halted; rx_return_work
+	 * and tx_work must not run after wnd is freed */
+	flush_workqueue(wrapndis_tx_wq);
+	flush_workqueue(wrapndis_wq);
+	ndis_return_packets(wnd);
+	tx_resend_purge(wnd);
 	ndis_exit_device(wnd);
+#ifdef WRAP_NAPI
+	rx_queue_purge(wnd);
+#endif
 
 	if (wnd->tx_packet_pool) {
 		NdisFreePacketPool(wnd->tx_packet_pool);
@@ -2050,6 +2410,8 @@ static int ndis_remove_device(struct ndis_device *wnd)
 		NdisFreeBufferPool(wnd->tx_buffer_pool);
 		wnd->tx_buffer_pool = NULL;
 	}
+	kfree(wnd->tx_ring);
+	wnd->tx_ring = NULL;
 	kfree(wnd->pmkids);
 	printk(KERN_INFO "%s: device %s removed\n", DRIVER_NAME,
 	       wnd->net_dev->name);
@@ -2121,14 +2483,24 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 		EXIT1(return STATUS_RESOURCES);
 	}
 	nmb->next_device = IoAttachDeviceToDeviceStack(fdo, pdo);
-	spin_lock_init(&wnd->tx_ring_lock);
 	mutex_init(&wnd->tx_ring_mutex);
 	mutex_init(&wnd->ndis_req_mutex);
 	wnd->ndis_req_done = 0;
 	INIT_WORK(&wnd->tx_work, tx_worker);
-	wnd->tx_ring_start = 0;
-	wnd->tx_ring_end = 0;
-	wnd->is_tx_ring_full = 0;
+#ifdef WRAP_NAPI
+	skb_queue_head_init(&wnd->rx_queue);
+	skb_queue_head_init(&wnd->rx_poll_queue);
+#endif
+	wnd->tx_ring = NULL;
+	wnd->tx_ring_size = 0;
+	wnd->tx_ring_prod = 0;
+	wnd->tx_ring_cons = 0;
+	spin_lock_init(&wnd->tx_resend_lock);
+	wnd->tx_resend_head = NULL;
+	wnd->tx_resend_tail = NULL;
+	init_timer(&wnd->tx_retry_timer);
+	wnd->tx_retry_timer.data = (unsigned long)wnd;
+	wnd->tx_retry_timer.function = tx_retry_proc;
 	wnd->capa.encr = 0;
 	wnd->capa.auth = 0;
 	wnd->attributes = 0;
@@ -2175,6 +2547,11 @@ int wrapndis_init(void)
 	if (!wrapndis_wq)
 		EXIT1(return -ENOMEM);
 	TRACE1("wrapndis_wq: %p", wrapndis_wq);
+	wrapndis_tx_wq = create_singlethread_workqueue("wrapndis_tx_wq");
+	if (!wrapndis_tx_wq) {
+		destroy_workqueue(wrapndis_wq);
+		EXIT1(return -ENOMEM);
+	}
 	register_netdevice_notifier(&netdev_notifier);
 	return 0;
 }
@@ -2182,6 +2559,8 @@ int wrapndis_init(void)
 void wrapndis_exit(void)
 {
 	unregister_netdevice_notifier(&netdev_notifier);
+	if (wrapndis_tx_wq)
+		destroy_workqueue(wrapndis_tx_wq);
 	if (wrapndis_wq)
 		destroy_workqueue(wrapndis_wq);
 }
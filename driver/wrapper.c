@@ -22,6 +22,13 @@
 char *if_name = "wlan%d";
 int proc_uid, proc_gid;
 int hangcheck_interval;
+int tx_ring_size = DEFAULT_TX_RING_SIZE;
+int tx_direct;
+int napi_weight = DEFAULT_NAPI_WEIGHT;
+int irq_thread;
+int pool_max_order = 3;
+int timer_slack;
+int usb_complete_inline;
 static char *utils_version = UTILS_VERSION;
 int debug = DEBUG;
 
@@ -45,6 +52,44 @@ module_param(hangcheck_interval, int, 0600);
 MODULE_PARM_DESC(hangcheck_interval, "The interval, in seconds, for checking"
 		 " if driver is hung. (default: 0)");
 
+/* per-device setting 'tx_ring_size' overrides this */
+module_param(tx_ring_size, int, 0400);
+MODULE_PARM_DESC(tx_ring_size, "Number of packets queued for transmit, "
+		 "rounded up to power of 2 (default: 256)");
+
+/* per-device setting 'tx_direct' overrides this */
+module_param(tx_direct, int, 0400);
+MODULE_PARM_DESC(tx_direct, "Send packets to deserialized drivers "
+		 "without going through tx worker (default: 0)");
+
+/* per-device setting 'napi_weight' overrides this */
+module_param(napi_weight, int, 0400);
+MODULE_PARM_DESC(napi_weight, "Maximum number of received packets "
+		 "passed to network stack at once (default: 64)");
+
+/* per-device setting 'irq_thread' overrides this */
+module_param(irq_thread, int, 0400);
+MODULE_PARM_DESC(irq_thread, "Run interrupt handler of drivers in "
+		 "irq thread instead of DPC worker (default: 0)");
+
+/* per-device setting 'timer_slack' overrides this */
+module_param(timer_slack, int, 0400);
+MODULE_PARM_DESC(timer_slack, "Time, in microseconds, periodic timers of "
+		 "drivers may expire late so they can be coalesced with "
+		 "other timers (default: 0)");
+
+/* per-device setting 'usb_complete_inline' overrides this */
+module_param(usb_complete_inline, int, 0400);
+MODULE_PARM_DESC(usb_complete_inline, "Complete bulk and interrupt "
+		 "requests that USB drivers submit at DISPATCH_LEVEL in "
+		 "softirq context instead of worker thread; needs "
+		 "IRQL_PREEMPT (default: 0)");
+
+module_param(pool_max_order, int, 0600);
+MODULE_PARM_DESC(pool_max_order, "Pool allocations up to 2^order pages "
+		 "are served by page allocator instead of vmalloc "
+		 "(default: 3)");
+
 module_param(utils_version, charp, 0400);
 MODULE_PARM_DESC(utils_version, "Compatible version of utils "
 		 "(read only: " UTILS_VERSION ")");
@@ -20,5 +20,12 @@ extern char *if_name;
 extern int proc_uid;
 extern int proc_gid;
 extern int hangcheck_interval;
+extern int tx_ring_size;
+extern int tx_direct;
+extern int napi_weight;
+extern int irq_thread;
+extern int pool_max_order;
+extern int timer_slack;
+extern int usb_complete_inline;
 
 #endif /* WRAPPER_H */